@@ -1,3 +1,5 @@
 from .main import main
 
-main()
+# Processes spawned to analyze tracks import this module without running it
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,263 @@
+from __future__ import annotations
+from array import array
+from concurrent.futures import ProcessPoolExecutor
+from itertools import repeat
+from multiprocessing import get_context
+from queue import SimpleQueue
+from threading import Thread
+from time import perf_counter
+from typing import Any, Iterable, NamedTuple, Optional
+
+from .song import MAX_VELOCITY, NOTES_PER_OCTAVE, Note, Song, Track
+
+# Velocities are counted in this many equal ranges
+VELOCITY_BUCKETS = 8
+
+# Notes are only analyzed once no edits have been made for this many seconds,
+# so that a burst of edits is analyzed once
+ANALYSIS_DELAY = 0.25
+
+
+# The notes of one track that start in one window of the song
+class WindowStats(NamedTuple):
+    notes: int
+    low: int
+    high: int
+    out_of_scale: int
+    velocities: tuple[int, ...]
+
+
+# The start times, numbers and velocities of a track's notes
+TrackColumns = tuple[array, array, array]
+
+# The window length in ticks, the semitones of the scale, and the ID of each
+# track and whether it plays drums
+AnalysisParams = tuple[int, frozenset[int], tuple[tuple[int, bool], ...]]
+
+
+def get_track_columns(notes: Iterable[Note]) -> TrackColumns:
+    times = array("q")
+    numbers = array("b")
+    velocities = array("B")
+    for note in notes:
+        times.append(note.time)
+        numbers.append(note.number)
+        velocities.append(note.velocity)
+    return times, numbers, velocities
+
+
+# Drum notes are never out of the scale, since their numbers are not pitches
+def analyze_track(
+    columns: TrackColumns,
+    window: int,
+    semitones: frozenset[int],
+    is_drum: bool,
+) -> dict[int, WindowStats]:
+    counts: dict[int, list[int]] = {}
+    for time, number, velocity in zip(*columns):
+        index = time // window
+        count = counts.get(index)
+        if count is None:
+            count = [0, number, number, 0] + [0] * VELOCITY_BUCKETS
+            counts[index] = count
+        count[0] += 1
+        if number < count[1]:
+            count[1] = number
+        elif number > count[2]:
+            count[2] = number
+        if not is_drum and number % NOTES_PER_OCTAVE not in semitones:
+            count[3] += 1
+        count[4 + velocity * VELOCITY_BUCKETS // (MAX_VELOCITY + 1)] += 1
+    return {
+        index: WindowStats(
+            count[0], count[1], count[2], count[3], tuple(count[4:])
+        )
+        for index, count in counts.items()
+    }
+
+
+def merge_stats(stats: Iterable[WindowStats]) -> Optional[WindowStats]:
+    merged = None
+    for window in stats:
+        if merged is None:
+            merged = window
+        else:
+            merged = WindowStats(
+                merged.notes + window.notes,
+                min(merged.low, window.low),
+                max(merged.high, window.high),
+                merged.out_of_scale + window.out_of_scale,
+                tuple(
+                    a + b for a, b in zip(merged.velocities, window.velocities)
+                ),
+            )
+    return merged
+
+
+def get_analysis_params(song: Song) -> AnalysisParams:
+    return (
+        song.beats_to_ticks(song.beats_per_measure),
+        frozenset(
+            (number + song.key) % NOTES_PER_OCTAVE for number in song.scale
+        ),
+        tuple((id(track), track.is_drum) for track in song.tracks),
+    )
+
+
+# Analyzes the notes of every track on another thread, keeping the results for
+# each measure so that only the measures that have been edited since are
+# analyzed again. The notes to analyze are copied into columns on the song's
+# thread. With several jobs, tracks are analyzed in parallel processes.
+class Analyzer:
+    jobs: int
+    params: Optional[AnalysisParams]
+    results: dict[int, dict[int, WindowStats]]
+    stale: Optional[set[int]]
+    edit_time: float
+    pending: bool
+    ready: bool
+    responses: SimpleQueue
+    executor: Optional[ProcessPoolExecutor]
+    version: int
+    summary: Optional[tuple[tuple[int, int], Optional[WindowStats]]]
+
+    def __init__(self, jobs: int = 1):
+        self.jobs = jobs
+        self.params = None
+        self.results = {}
+        self.stale = None
+        self.edit_time = 0.0
+        self.pending = False
+        self.ready = False
+        self.responses = SimpleQueue()
+        self.executor = None
+        self.version = 0
+        self.summary = None
+
+    # Whether there is analysis still to be done or waiting to be received
+    @property
+    def busy(self) -> bool:
+        return self.pending or self.stale is None or len(self.stale) > 0
+
+    # Called with the song's changes every frame. The song's dirty flag is set
+    # by every edit, and the windows of the notes that changed are marked for
+    # analysis again, or every window if the changes are unknown.
+    def invalidate(
+        self, song: Song, changes: Optional[list[tuple[int, int, int]]]
+    ) -> None:
+        if not song.dirty:
+            return
+        song.dirty = False
+        self.edit_time = perf_counter()
+        if changes is None or self.params is None:
+            self.stale = None
+        elif self.stale is not None:
+            window = self.params[0]
+            self.stale.update(start // window for start, _, _ in changes)
+
+    # Sends the notes of the stale windows to be analyzed, unless analysis is
+    # already under way or the song is still being edited
+    def start(self, song: Song) -> None:
+        params = get_analysis_params(song)
+        if params != self.params:
+            self.params = params
+            self.results = {}
+            self.stale = None
+            self.ready = False
+            self.version += 1
+        if self.pending or (self.stale is not None and len(self.stale) == 0):
+            return
+        if perf_counter() - self.edit_time < ANALYSIS_DELAY:
+            return
+
+        window = params[0]
+        windows = self.stale
+        jobs = []
+        for track in song.tracks:
+            if windows is None:
+                notes = song.get_notes_starting_between(0, None, track)
+            else:
+                notes = [
+                    note
+                    for index in windows
+                    for note in song.get_notes_starting_between(
+                        index * window, (index + 1) * window, track
+                    )
+                ]
+            jobs.append((id(track), get_track_columns(notes), track.is_drum))
+        self.stale = set()
+        self.pending = True
+        Thread(
+            target=self.run, args=(params, windows, jobs), daemon=True
+        ).start()
+
+    def run(
+        self,
+        params: AnalysisParams,
+        windows: Optional[set[int]],
+        jobs: list[tuple[int, TrackColumns, bool]],
+    ) -> None:
+        window, semitones, _ = params
+        arguments: list[Iterable[Any]] = [
+            [columns for _, columns, _ in jobs],
+            repeat(window),
+            repeat(semitones),
+            [is_drum for _, _, is_drum in jobs],
+        ]
+        results = None
+        if self.jobs > 1 and len(jobs) > 1:
+            # Processes are spawned rather than forked, since the editor is
+            # already running other threads
+            try:
+                if self.executor is None:
+                    self.executor = ProcessPoolExecutor(
+                        max_workers=self.jobs, mp_context=get_context("spawn")
+                    )
+                results = list(self.executor.map(analyze_track, *arguments))
+            except Exception:
+                # Tracks are analyzed here from then on
+                self.jobs = 1
+        if results is None:
+            results = list(map(analyze_track, *arguments))
+        track_ids = [track_id for track_id, _, _ in jobs]
+        self.responses.put((params, windows, dict(zip(track_ids, results))))
+
+    # Returns whether there are new results to show, which is checked from the
+    # main loop so that the results only ever change on the song's thread
+    def receive(self) -> bool:
+        changed = False
+        while not self.responses.empty():
+            params, windows, results = self.responses.get()
+            self.pending = False
+            # Results for settings that have since changed are discarded
+            if params != self.params:
+                continue
+            if windows is None:
+                self.results = results
+            else:
+                for track_id, track_results in results.items():
+                    merged = self.results.setdefault(track_id, {})
+                    for index in windows:
+                        merged.pop(index, None)
+                    merged.update(track_results)
+            self.ready = True
+            self.version += 1
+            changed = True
+        return changed
+
+    @property
+    def window(self) -> Optional[int]:
+        return self.params[0] if self.params is not None else None
+
+    def get_results(self, track: Track) -> dict[int, WindowStats]:
+        return self.results.get(id(track), {})
+
+    def get_summary(self, track: Track) -> Optional[WindowStats]:
+        key = self.version, id(track)
+        if self.summary is None or self.summary[0] != key:
+            self.summary = key, merge_stats(self.get_results(track).values())
+        return self.summary[1]
+
+    def close(self) -> None:
+        if self.executor is not None:
+            self.executor.shutdown(cancel_futures=True)
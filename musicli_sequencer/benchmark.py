@@ -0,0 +1,346 @@
+import argparse
+import curses
+import gc
+import json
+from operator import attrgetter, itemgetter
+import os
+import os.path
+from random import Random
+import sys
+from tempfile import TemporaryDirectory
+from time import perf_counter
+import tracemalloc
+from typing import Any, Callable, Optional
+from unittest.mock import patch
+
+from .analysis import analyze_track, get_analysis_params, get_track_columns
+from .interface import Interface
+from .song import (
+    DRUM_CHANNEL,
+    IMPORT_MIDO,
+    TOTAL_NOTES,
+    Note,
+    Song,
+)
+from .stats import Stat
+
+DEFAULT_EVENTS = [10000, 100000]
+DEFAULT_TRACKS = [1, 16]
+DEFAULT_OPERATIONS = 1000
+DEFAULT_FRAMES = 100
+DEFAULT_REPEAT = 3
+DEFAULT_TOLERANCE = 0.25
+
+# Tracks past the sixteenth share channels, since MIDI only has sixteen
+CHANNELS = [channel for channel in range(16) if channel != DRUM_CHANNEL]
+
+# The size of the fake terminal that notes are drawn to
+WINDOW_ROWS = 50
+WINDOW_COLUMNS = 200
+
+# Each result is the mean and maximum time of an operation in seconds, or a
+# number of bytes for memory
+Results = dict[str, dict[str, float]]
+
+
+class FakeWindow:
+    def getmaxyx(self) -> tuple[int, int]:
+        return WINDOW_ROWS, WINDOW_COLUMNS
+
+    def addstr(self, y: int, x: int, string: str, attr: int) -> None:
+        pass
+
+    def erase(self) -> None:
+        pass
+
+    def refresh(self) -> None:
+        pass
+
+
+# Notes of random pitches and lengths, spread evenly over the tracks and
+# starting a little after each other, so that songs of every size are equally
+# dense
+def generate_song(
+    events: int, tracks: int, random: Random, compact: bool = False
+) -> Song:
+    song = Song(compact=compact)
+    for index in range(1, tracks):
+        song.create_track(CHANNELS[index % len(CHANNELS)])
+    time = 0
+    notes = []
+    for _ in range(events // 2):
+        time += random.randrange(song.ticks_per_beat // 4)
+        notes.append(
+            Note(
+                True,
+                random.randrange(24, TOTAL_NOTES - 24),
+                time,
+                random.choice(song.tracks),
+                random.randrange(1, 128),
+                duration=random.randrange(1, song.ticks_per_beat * 2),
+            )
+        )
+    # Built the way an imported song is, so that compact songs keep no
+    # events cached
+    events = [event for note in notes for event in (note, note.pair)]
+    events.sort(key=attrgetter("sort_key"))
+    song.set_events(events)
+    return song
+
+
+def time_each(
+    function: Callable[[Any], Any], arguments: list[Any]
+) -> dict[str, float]:
+    stat = Stat(function.__name__)
+    for argument in arguments:
+        start = perf_counter()
+        function(argument)
+        stat.record(perf_counter() - start)
+    return {"mean": stat.mean, "max": stat.max}
+
+
+def time_once(function: Callable[[], Any]) -> dict[str, float]:
+    start = perf_counter()
+    function()
+    seconds = perf_counter() - start
+    return {"mean": seconds, "max": seconds}
+
+
+def benchmark_song(
+    events: int,
+    tracks: int,
+    operations: int,
+    frames: int,
+    seed: int,
+    compact: bool,
+) -> Results:
+    random = Random(seed)
+    results = {}
+
+    # The song's memory is measured while it is built, since tracing
+    # allocations would slow down everything timed afterwards
+    gc.collect()
+    tracemalloc.start()
+    song = generate_song(events, tracks, random, compact)
+    # Notes and their pairs refer to each other, so the ones that were only
+    # needed while building the song are freed by collecting them
+    gc.collect()
+    current, _ = tracemalloc.get_traced_memory()
+    tracemalloc.stop()
+    results["memory"] = {"mean": current / len(song), "max": current}
+
+    length = song.end
+    notes = [
+        Note(
+            True,
+            random.randrange(TOTAL_NOTES),
+            random.randrange(length),
+            random.choice(song.tracks),
+            duration=random.randrange(1, song.ticks_per_beat * 2),
+        )
+        for _ in range(operations)
+    ]
+    results["add_note"] = time_each(song.add_note, notes)
+    results["remove_note"] = time_each(song.remove_note, notes)
+
+    queries = [
+        (random.randrange(length), random.choice([None, *song.tracks]))
+        for _ in range(operations)
+    ]
+    results["get_next_chord"] = time_each(
+        lambda query: song.get_next_chord(*query), queries
+    )
+    results["get_previous_chord"] = time_each(
+        lambda query: song.get_previous_chord(*query), queries
+    )
+
+    window, semitones, _ = get_analysis_params(song)
+    results["analyze"] = time_once(
+        lambda: [
+            analyze_track(
+                get_track_columns(
+                    song.get_notes_starting_between(0, None, track)
+                ),
+                window,
+                semitones,
+                track.is_drum,
+            )
+            for track in song.tracks
+        ]
+    )
+
+    with TemporaryDirectory() as directory:
+        path = os.path.join(directory, "benchmark.mid")
+        results["export_midi"] = time_once(lambda: song.export_midi(path))
+        if IMPORT_MIDO:
+            results["import_midi"] = time_once(
+                lambda: Song(midi_file=path, compact=compact)
+            )
+
+    # Colors can only be set up once curses has been initialized, so any
+    # attribute will do for drawing to the fake window
+    with patch.multiple(
+        curses, init_pair=lambda *_: None, color_pair=lambda pair: pair << 8
+    ):
+        interface = Interface(FakeWindow(), song)  # type: ignore[arg-type]
+        offsets = [
+            random.randrange(song.ticks_to_cols(length)) for _ in range(frames)
+        ]
+
+        def draw_notes(x_offset: int) -> None:
+            interface.x_offset = x_offset
+            interface.draw_notes()
+
+        results["draw_notes"] = time_each(draw_notes, offsets)
+        results["draw_sidebar"] = time_each(
+            lambda _: interface.draw_sidebar(), offsets
+        )
+        results["draw_status_bar"] = time_each(
+            lambda _: interface.draw_status_bar(), offsets
+        )
+    return results
+
+
+# Returns a description of each result that is worse than the baseline by more
+# than the tolerance
+def compare(
+    results: dict[str, Results], baseline: dict[str, Results], tolerance: float
+) -> list[str]:
+    regressions = []
+    for size, size_results in results.items():
+        for name, result in size_results.items():
+            expected = baseline.get(size, {}).get(name)
+            if expected is None or expected["mean"] <= 0:
+                continue
+            ratio = result["mean"] / expected["mean"]
+            if ratio > 1 + tolerance:
+                regressions.append(f"{size} {name}: {ratio:.2f}x baseline")
+    return regressions
+
+
+def format_result(name: str, result: dict[str, float]) -> str:
+    if name == "memory":
+        return (
+            f"{name:>20}: {result['mean']:10.1f} B/event "
+            f"{result['max'] / 2**20:10.1f} MiB"
+        )
+    return (
+        f"{name:>20}: {result['mean'] * 1000:10.3f} ms avg "
+        f"{result['max'] * 1000:10.3f} ms max"
+    )
+
+
+def main(args: Optional[list[str]] = None) -> int:
+    parser = argparse.ArgumentParser(
+        prog="python -m musicli_sequencer.benchmark",
+        description="Time song edits, queries, MIDI files and drawing on "
+        "generated songs",
+    )
+    parser.add_argument(
+        "--events",
+        type=int,
+        nargs="+",
+        default=DEFAULT_EVENTS,
+        help="number of events in each generated song",
+    )
+    parser.add_argument(
+        "--tracks",
+        type=int,
+        nargs="+",
+        default=DEFAULT_TRACKS,
+        help="number of tracks in each generated song",
+    )
+    parser.add_argument(
+        "--operations",
+        type=int,
+        default=DEFAULT_OPERATIONS,
+        help="number of edits and queries to time for each song",
+    )
+    parser.add_argument(
+        "--frames",
+        type=int,
+        default=DEFAULT_FRAMES,
+        help="number of times to draw the notes of each song",
+    )
+    parser.add_argument(
+        "--repeat",
+        type=int,
+        default=DEFAULT_REPEAT,
+        help="number of times to run each benchmark, keeping the fastest",
+    )
+    parser.add_argument(
+        "--seed",
+        type=int,
+        default=0,
+        help="seed for generating songs, edits and queries",
+    )
+    parser.add_argument(
+        "--compact",
+        action="store_true",
+        help="store events in packed columns",
+    )
+    parser.add_argument(
+        "--baseline",
+        type=str,
+        help="JSON file of previous results to compare against",
+    )
+    parser.add_argument(
+        "--tolerance",
+        type=float,
+        default=DEFAULT_TOLERANCE,
+        help="fraction by which a result may exceed the baseline before it "
+        "counts as a regression",
+    )
+    parser.add_argument(
+        "--save",
+        type=str,
+        help="JSON file to save the results to, for use as a baseline",
+    )
+    args = parser.parse_args(args)
+
+    results = {}
+    for events in args.events:
+        for tracks in args.tracks:
+            size = f"{events} events, {tracks} tracks"
+            if args.compact:
+                size += ", compact"
+            print(size)
+            # The fastest of several runs is the least affected by whatever
+            # else the machine is doing
+            runs = [
+                benchmark_song(
+                    events,
+                    tracks,
+                    args.operations,
+                    args.frames,
+                    args.seed,
+                    args.compact,
+                )
+                for _ in range(args.repeat)
+            ]
+            results[size] = {
+                name: min((run[name] for run in runs), key=itemgetter("mean"))
+                for name in runs[0]
+            }
+            for name, result in results[size].items():
+                print(format_result(name, result))
+
+    if args.save is not None:
+        with open(args.save, "w") as file:
+            json.dump(results, file, indent=2)
+
+    if args.baseline is not None:
+        with open(args.baseline, "r") as file:
+            baseline = json.load(file)
+        regressions = compare(results, baseline, args.tolerance)
+        if len(regressions) > 0:
+            print(f"{len(regressions)} regressions:")
+            for regression in regressions:
+                print(f"  {regression}")
+            return 1
+        print("No regressions")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,217 @@
+from array import array
+from typing import Iterable, Iterator, Optional
+from weakref import WeakValueDictionary
+
+from .eventlist import EventList
+from .song import IntervalIndex, Note, SongEvent, Track
+
+NO_SLOT = -1
+
+
+# Stores song events as packed columns, indexed by a slot number that is
+# assigned when an event is added and stays the same until it is removed.
+# Events are only created as Python objects while something is using them.
+class EventColumns:
+    times: array
+    numbers: array
+    velocities: array
+    track_ids: array
+    pairs: array
+    on: array
+    refs: array
+    messages: dict[int, SongEvent]
+    tracks: list[Optional[Track]]
+    track_ids_by_id: dict[int, int]
+    free: list[int]
+    cache: WeakValueDictionary
+
+    def __init__(self):
+        self.times = array("q")
+        self.numbers = array("b")
+        self.velocities = array("B")
+        self.track_ids = array("H")
+        self.pairs = array("i")
+        self.on = array("B")
+        self.refs = array("B")
+        self.messages = {}
+        self.tracks = [None]
+        self.track_ids_by_id = {id(None): 0}
+        self.free = []
+        self.cache = WeakValueDictionary()
+
+    def __len__(self) -> int:
+        return len(self.times) - len(self.free)
+
+    def get_track_id(self, track: Optional[Track]) -> int:
+        track_id = self.track_ids_by_id.get(id(track))
+        if track_id is None:
+            track_id = len(self.tracks)
+            self.tracks.append(track)
+            self.track_ids_by_id[id(track)] = track_id
+        return track_id
+
+    def allocate(self) -> int:
+        if len(self.free) > 0:
+            return self.free.pop()
+        self.times.append(0)
+        self.numbers.append(0)
+        self.velocities.append(0)
+        self.track_ids.append(0)
+        self.pairs.append(NO_SLOT)
+        self.on.append(0)
+        self.refs.append(0)
+        return len(self.times) - 1
+
+    def write(self, slot: int, event: SongEvent, cache: bool = True) -> None:
+        self.times[slot] = event.time
+        self.track_ids[slot] = self.get_track_id(event.track)
+        self.pairs[slot] = NO_SLOT
+        if isinstance(event, Note):
+            self.numbers[slot] = event.number
+            self.velocities[slot] = event.velocity
+            self.on[slot] = event.on
+            if event.pair is not None and event.pair.slot is not None:
+                self.pairs[slot] = event.pair.slot
+                self.pairs[event.pair.slot] = slot
+        else:
+            self.numbers[slot] = -1
+            self.messages[slot] = event
+        if cache:
+            self.cache[slot] = event
+
+    # Events that are not cached will be recreated the next time they are used
+    def acquire(self, event: SongEvent, cache: bool = True) -> int:
+        if event.slot is None:
+            event.slot = self.allocate()
+            self.write(event.slot, event, cache)
+        self.refs[event.slot] += 1
+        return event.slot
+
+    def acquire_uncached(self, event: SongEvent) -> int:
+        return self.acquire(event, cache=False)
+
+    # The cache's table does not shrink on its own after a bulk operation
+    def compact_cache(self) -> None:
+        self.cache = WeakValueDictionary(self.cache)
+
+    def release(self, slot: int) -> None:
+        self.refs[slot] -= 1
+        if self.refs[slot] > 0:
+            return
+        pair = self.pairs[slot]
+        if pair != NO_SLOT:
+            self.pairs[pair] = NO_SLOT
+        # Messages are not always cached, but must forget their slot too
+        message = self.messages.pop(slot, None)
+        event = self.cache.pop(slot, message)
+        if event is not None:
+            event.slot = None
+        self.free.append(slot)
+
+    def update(self, event: SongEvent) -> None:
+        if isinstance(event, Note) and event.slot is not None:
+            self.velocities[event.slot] = event.velocity
+
+    def create(self, slot: int) -> SongEvent:
+        if self.numbers[slot] < 0:
+            return self.messages[slot]
+        note = Note(
+            on=bool(self.on[slot]),
+            number=self.numbers[slot],
+            time=self.times[slot],
+            track=self.tracks[self.track_ids[slot]],
+            velocity=self.velocities[slot],
+        )
+        note.slot = slot
+        self.cache[slot] = note
+        return note
+
+    def materialize(self, slot: int) -> SongEvent:
+        event = self.cache.get(slot)
+        if event is None:
+            event = self.create(slot)
+            pair_slot = self.pairs[slot]
+            if isinstance(event, Note) and pair_slot != NO_SLOT:
+                pair = self.cache.get(pair_slot)
+                if pair is None:
+                    pair = self.create(pair_slot)
+                event.pair = pair
+                pair.pair = event
+        return event
+
+    def matches(self, slot: int, event: SongEvent) -> bool:
+        # Events with the same sort key only differ by their channel
+        track = self.tracks[self.track_ids[slot]]
+        if not isinstance(event, Note) or track is None:
+            return False
+        return track.channel == event.channel
+
+
+class ColumnarEventList(EventList):
+    columns: EventColumns
+
+    def __init__(self, columns: EventColumns, events: Iterable = ()):
+        self.columns = columns
+        super().__init__(events)
+
+    def new_block(self, events: list):
+        return array("i", map(self.columns.acquire_uncached, events))
+
+    def to_item(self, event) -> int:
+        return self.columns.acquire(event)
+
+    def to_event(self, item: int):
+        return self.columns.materialize(item)
+
+    def release(self, item: int) -> None:
+        self.columns.release(item)
+
+    def update(self, event) -> None:
+        self.columns.update(event)
+
+    def is_match(self, item: int, event, lookup: bool) -> bool:
+        return item == event.slot or (
+            lookup and self.columns.matches(item, event)
+        )
+
+    def __iter__(self) -> Iterator:
+        materialize = self.columns.materialize
+        for block in self.blocks:
+            for slot in block:
+                yield materialize(slot)
+
+    def __reversed__(self) -> Iterator:
+        materialize = self.columns.materialize
+        for block in reversed(self.blocks):
+            for slot in reversed(block):
+                yield materialize(slot)
+
+    def __repr__(self) -> str:
+        return f"ColumnarEventList({list(self)})"
+
+
+class ColumnarIntervalIndex(IntervalIndex):
+    columns: EventColumns
+
+    def __init__(self, columns: EventColumns):
+        super().__init__()
+        self.columns = columns
+
+    def new_bin(self):
+        return array("i")
+
+    def to_item(self, note: Note) -> int:
+        assert note.slot is not None
+        return note.slot
+
+    def is_match(self, item: int, note: Note) -> bool:
+        return item == note.slot
+
+    def to_event(self, item: int) -> Note:
+        note = self.columns.materialize(item)
+        assert isinstance(note, Note)
+        return note
+
+    def span(self, item: int) -> tuple[int, int]:
+        times = self.columns.times
+        return times[item], times[self.columns.pairs[item]]
@@ -0,0 +1,303 @@
+from array import array
+from bisect import bisect_left, bisect_right
+from itertools import accumulate, islice
+from operator import attrgetter, gt, itemgetter
+from typing import Iterable, Iterator, Optional
+
+# Events are kept in blocks of roughly this many events, so that an edit only
+# shifts the contents of one block rather than the whole song
+BLOCK_SIZE = 1000
+
+get_sort_key = attrgetter("sort_key")
+
+
+class EventList:
+    keys: list[array]
+    blocks: list[list]
+    maxes: list[int]
+    offsets: Optional[list[int]]
+    length: int
+
+    def __init__(self, events: Iterable = ()):
+        # Each key is only computed once, and events that are already in order
+        # are not moved
+        events = list(events)
+        keys = list(map(get_sort_key, events))
+        if any(map(gt, keys, islice(keys, 1, None))):
+            order = sorted(range(len(keys)), key=keys.__getitem__)
+            events = [events[index] for index in order]
+            keys = [keys[index] for index in order]
+        self.keys = []
+        self.blocks = []
+        for start in range(0, len(events), BLOCK_SIZE):
+            self.keys.append(array("q", keys[start : start + BLOCK_SIZE]))
+            self.blocks.append(
+                self.new_block(events[start : start + BLOCK_SIZE])
+            )
+        self.maxes = [keys[-1] for keys in self.keys]
+        self.offsets = None
+        self.length = len(events)
+
+    # Subclasses may store something other than the events themselves in each
+    # block by overriding these methods
+
+    def new_block(self, events: list):
+        return events
+
+    def to_item(self, event):
+        return event
+
+    def to_event(self, item):
+        return item
+
+    def release(self, item) -> None:
+        pass
+
+    def is_match(self, item, event, lookup: bool) -> bool:
+        return item is event or (lookup and item == event)
+
+    # Called when an event in the list changes without changing its sort key
+    def update(self, event) -> None:
+        pass
+
+    def clear(self) -> None:
+        for block in self.blocks:
+            for item in block:
+                self.release(item)
+        self.keys = []
+        self.blocks = []
+        self.maxes = []
+        self.offsets = None
+        self.length = 0
+
+    def get_offsets(self) -> list[int]:
+        if self.offsets is None:
+            self.offsets = [0]
+            self.offsets.extend(accumulate(map(len, self.blocks)))
+        return self.offsets
+
+    def locate(self, index: int) -> tuple[int, int]:
+        if index < 0:
+            index += self.length
+        if not 0 <= index < self.length:
+            raise IndexError("event index out of range")
+        offsets = self.get_offsets()
+        block_index = bisect_right(offsets, index) - 1
+        return block_index, index - offsets[block_index]
+
+    def bisect_key_left(self, key: int) -> int:
+        block_index = bisect_left(self.maxes, key)
+        if block_index == len(self.blocks):
+            return self.length
+        offset = self.get_offsets()[block_index]
+        return offset + bisect_left(self.keys[block_index], key)
+
+    def bisect_key_right(self, key: int) -> int:
+        block_index = bisect_right(self.maxes, key)
+        if block_index == len(self.blocks):
+            return self.length
+        offset = self.get_offsets()[block_index]
+        return offset + bisect_right(self.keys[block_index], key)
+
+    def find(self, event, lookup: bool = False) -> tuple[int, int]:
+        # Events with equal keys may span several blocks
+        key = event.sort_key
+        block_index = bisect_left(self.maxes, key)
+        while block_index < len(self.blocks):
+            keys = self.keys[block_index]
+            block = self.blocks[block_index]
+            position = bisect_left(keys, key)
+            while position < len(keys) and keys[position] == key:
+                if self.is_match(block[position], event, lookup):
+                    return block_index, position
+                position += 1
+            if position < len(keys):
+                break
+            block_index += 1
+        raise ValueError(f"{event} is not in the list of events")
+
+    def index(self, event, lookup: bool = False) -> int:
+        block_index, position = self.find(event, lookup)
+        return self.get_offsets()[block_index] + position
+
+    def add(self, event) -> None:
+        key = event.sort_key
+        if len(self.blocks) == 0:
+            self.keys.append(array("q"))
+            self.blocks.append(self.new_block([]))
+            self.maxes.append(key)
+        block_index = min(bisect_right(self.maxes, key), len(self.blocks) - 1)
+        keys = self.keys[block_index]
+        block = self.blocks[block_index]
+        position = bisect_right(keys, key)
+        keys.insert(position, key)
+        block.insert(position, self.to_item(event))
+        self.maxes[block_index] = keys[-1]
+        if len(block) > 2 * BLOCK_SIZE:
+            self.split(block_index)
+        self.offsets = None
+        self.length += 1
+
+    def split(self, block_index: int) -> None:
+        keys = self.keys[block_index]
+        block = self.blocks[block_index]
+        half = len(block) // 2
+        self.keys[block_index : block_index + 1] = keys[:half], keys[half:]
+        self.blocks[block_index : block_index + 1] = block[:half], block[half:]
+        self.maxes[block_index : block_index + 1] = keys[half - 1], keys[-1]
+
+    # Splits a block that grew by many events at once into regular blocks
+    def rechunk(self, block_index: int) -> None:
+        keys = self.keys[block_index]
+        block = self.blocks[block_index]
+        starts = range(0, len(block), BLOCK_SIZE)
+        new_keys = [keys[start : start + BLOCK_SIZE] for start in starts]
+        self.keys[block_index : block_index + 1] = new_keys
+        self.blocks[block_index : block_index + 1] = [
+            block[start : start + BLOCK_SIZE] for start in starts
+        ]
+        self.maxes[block_index : block_index + 1] = [
+            keys[-1] for keys in new_keys
+        ]
+
+    def delete(self, block_index: int, position: int) -> None:
+        keys = self.keys[block_index]
+        block = self.blocks[block_index]
+        self.release(block[position])
+        del keys[position]
+        del block[position]
+        if len(block) > 0:
+            self.maxes[block_index] = keys[-1]
+        else:
+            del self.keys[block_index]
+            del self.blocks[block_index]
+            del self.maxes[block_index]
+        self.offsets = None
+        self.length -= 1
+
+    def remove(self, event, lookup: bool = False) -> None:
+        self.delete(*self.find(event, lookup))
+
+    # Adds many events at once, merging them into each block they belong in
+    # with a single pass over the block
+    def add_many(self, events: Iterable) -> None:
+        keyed = sorted(
+            ((event.sort_key, event) for event in events), key=itemgetter(0)
+        )
+        if len(keyed) == 0:
+            return
+        if len(self.blocks) == 0:
+            self.keys.append(array("q"))
+            self.blocks.append(self.new_block([]))
+            self.maxes.append(keyed[0][0])
+        groups: dict[int, list] = {}
+        last_block = len(self.blocks) - 1
+        for item in keyed:
+            block_index = min(bisect_right(self.maxes, item[0]), last_block)
+            groups.setdefault(block_index, []).append(item)
+
+        # Later blocks are merged first, so that splitting them does not move
+        # the blocks that are still to be merged
+        for block_index in sorted(groups, reverse=True):
+            keys = self.keys[block_index]
+            block = self.blocks[block_index]
+            new_keys = array("q")
+            new_block = block[:0]
+            position = 0
+            for key, event in groups[block_index]:
+                end = bisect_right(keys, key, position)
+                new_keys.extend(keys[position:end])
+                new_block.extend(block[position:end])
+                new_keys.append(key)
+                new_block.append(self.to_item(event))
+                position = end
+            new_keys.extend(keys[position:])
+            new_block.extend(block[position:])
+            self.keys[block_index] = new_keys
+            self.blocks[block_index] = new_block
+            self.maxes[block_index] = new_keys[-1]
+            if len(new_block) > 2 * BLOCK_SIZE:
+                self.rechunk(block_index)
+        self.offsets = None
+        self.length += len(keyed)
+
+    # Removes many events at once, rebuilding each block they are in once
+    def remove_many(self, events: Iterable, lookup: bool = False) -> None:
+        groups: dict[int, set[int]] = {}
+        for event in events:
+            block_index, position = self.find(event, lookup)
+            groups.setdefault(block_index, set()).add(position)
+        count = sum(map(len, groups.values()))
+
+        for block_index in sorted(groups, reverse=True):
+            positions = groups[block_index]
+            keys = self.keys[block_index]
+            block = self.blocks[block_index]
+            for position in positions:
+                self.release(block[position])
+            if len(positions) == len(block):
+                del self.keys[block_index]
+                del self.blocks[block_index]
+                del self.maxes[block_index]
+                continue
+            kept = [
+                position
+                for position in range(len(block))
+                if position not in positions
+            ]
+            self.keys[block_index] = array("q", map(keys.__getitem__, kept))
+            new_block = block[:0]
+            new_block.extend(map(block.__getitem__, kept))
+            self.blocks[block_index] = new_block
+            self.maxes[block_index] = self.keys[block_index][-1]
+        self.offsets = None
+        self.length -= count
+
+    def pop(self, index: int = -1):
+        block_index, position = self.locate(index)
+        event = self.to_event(self.blocks[block_index][position])
+        self.delete(block_index, position)
+        return event
+
+    def islice(self, start: int = 0, stop: Optional[int] = None) -> Iterator:
+        stop = self.length if stop is None else min(stop, self.length)
+        if start >= stop:
+            return
+        block_index, position = self.locate(start)
+        for _ in range(stop - start):
+            block = self.blocks[block_index]
+            yield self.to_event(block[position])
+            position += 1
+            if position == len(block):
+                block_index += 1
+                position = 0
+
+    def __len__(self) -> int:
+        return self.length
+
+    def __getitem__(self, key):
+        if isinstance(key, slice):
+            start, stop, step = key.indices(self.length)
+            if step != 1:
+                return list(self)[key]
+            return list(self.islice(start, stop))
+        block_index, position = self.locate(key)
+        return self.to_event(self.blocks[block_index][position])
+
+    def __iter__(self) -> Iterator:
+        for block in self.blocks:
+            yield from block
+
+    def __reversed__(self) -> Iterator:
+        for block in reversed(self.blocks):
+            yield from reversed(block)
+
+    def __contains__(self, event) -> bool:
+        try:
+            self.find(event, lookup=True)
+        except ValueError:
+            return False
+        return True
+
+    def __repr__(self) -> str:
+        return f"EventList({list(self)})"
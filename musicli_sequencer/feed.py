@@ -0,0 +1,162 @@
+from __future__ import annotations
+from dataclasses import dataclass
+from typing import (
+    Any,
+    Iterable,
+    Iterator,
+    NamedTuple,
+    Optional,
+    TYPE_CHECKING,
+)
+
+from .eventlist import EventList
+
+if TYPE_CHECKING:
+    from .song import TempoMap
+
+# The number of edits that can be waiting for the player at once; once the ring
+# is full, a new snapshot of the whole song is published instead
+RING_CAPACITY = 4096
+
+ADD = 0
+REMOVE = 1
+
+
+# An immutable copy of a song event, holding only what playback needs
+class ScheduledEvent(NamedTuple):
+    sort_key: int
+    time: int
+    channel: Optional[int]
+    number: int
+    velocity: int
+    on: bool
+    message: Any
+
+    @property
+    def is_note(self) -> bool:
+        return self.message is None
+
+
+# A single-producer, single-consumer queue. The producer only ever writes the
+# tail and the consumer only ever writes the head, so neither needs a lock.
+class EventRing:
+    slots: list
+    head: int
+    tail: int
+
+    def __init__(self, capacity: int = RING_CAPACITY):
+        self.slots = [None] * capacity
+        self.head = 0
+        self.tail = 0
+
+    def push(self, item) -> bool:
+        tail = self.tail
+        if tail - self.head >= len(self.slots):
+            return False
+        self.slots[tail % len(self.slots)] = item
+        self.tail = tail + 1
+        return True
+
+    def drain(self) -> Iterator:
+        head = self.head
+        while head != self.tail:
+            index = head % len(self.slots)
+            item = self.slots[index]
+            self.slots[index] = None
+            head += 1
+            self.head = head
+            yield item
+
+
+@dataclass(frozen=True)
+class Snapshot:
+    events: tuple[ScheduledEvent, ...]
+    tempo_map: TempoMap
+    ticks_per_unit: int
+    ring: EventRing
+
+
+# Passes a song's events from the thread editing it to the thread playing it.
+# The editing thread publishes a snapshot of the whole song, followed by the
+# individual events that are added or removed after it.
+class Feed:
+    snapshot: Optional[Snapshot]
+
+    def __init__(self):
+        self.snapshot = None
+
+    def publish_snapshot(
+        self,
+        events: Iterable[ScheduledEvent],
+        tempo_map: TempoMap,
+        ticks_per_unit: int,
+    ) -> None:
+        self.snapshot = Snapshot(
+            tuple(events), tempo_map, ticks_per_unit, EventRing()
+        )
+
+    # Returns False if the edit could not be published, in which case a new
+    # snapshot must be published
+    def publish(self, action: int, event: ScheduledEvent) -> bool:
+        if self.snapshot is None:
+            return False
+        return self.snapshot.ring.push((action, event))
+
+
+# The playing thread's own copy of the song's events, kept up to date from a
+# feed
+class Schedule:
+    snapshot: Snapshot
+    events: EventList
+    # The first and last times changed by the last update, or None if the
+    # whole song was replaced
+    touched: Optional[tuple[int, int]]
+
+    def __init__(self, snapshot: Snapshot):
+        self.snapshot = snapshot
+        self.events = EventList(snapshot.events)
+        self.touched = None
+
+    @property
+    def tempo_map(self) -> TempoMap:
+        return self.snapshot.tempo_map
+
+    @property
+    def ticks_per_unit(self) -> int:
+        return self.snapshot.ticks_per_unit
+
+    # Applies everything published since the last update, returning whether
+    # anything changed
+    def update(self, feed: Feed) -> bool:
+        snapshot = feed.snapshot
+        assert snapshot is not None
+        changed = False
+        replaced = False
+        if snapshot is not self.snapshot:
+            self.snapshot = snapshot
+            self.events = EventList(snapshot.events)
+            changed = replaced = True
+        first = last = 0
+        for action, event in snapshot.ring.drain():
+            if action == ADD:
+                self.events.add(event)
+            else:
+                try:
+                    self.events.remove(event, lookup=True)
+                except ValueError:
+                    pass
+            if not changed:
+                first = last = event.time
+            first = min(first, event.time)
+            last = max(last, event.time)
+            changed = True
+        if changed:
+            self.touched = None if replaced else (first, last)
+        return changed
+
+    # Whether the last update changed any events from the start time up to
+    # but not including the end time
+    def touches(self, start: int, end: int) -> bool:
+        return self.touched is None or (
+            self.touched[0] < end and self.touched[1] >= start
+        )
@@ -0,0 +1,159 @@
+from __future__ import annotations
+from collections import deque
+from typing import Any, Iterable, Optional, TYPE_CHECKING
+
+from .feed import ADD, REMOVE
+
+if TYPE_CHECKING:
+    from .player import Player
+    from .song import Song
+
+# Kinds of changes besides notes being added and removed
+TRACK_ADD = 2
+TRACK_REMOVE = 3
+TRACK_CHANNEL = 4
+TRACK_INSTRUMENT = 5
+MESSAGES_ADD = 6
+
+# The oldest steps are forgotten once there are more than this many, or once
+# they hold more than this many changes in total
+MAX_UNDO_STEPS = 1024
+MAX_UNDO_CHANGES = 65536
+
+# The kind of change, the note or track it applies to, and what is needed to
+# redo it: a note's start time, duration, number and velocity, a track's index
+# and events, a track's old and new channel or instrument, or the events added
+# outside of any track
+Change = tuple[int, Any, Any]
+
+
+def get_change_size(change: Change) -> int:
+    kind, _, value = change
+    if kind in (TRACK_ADD, TRACK_REMOVE):
+        return len(value[1])
+    if kind == MESSAGES_ADD:
+        return len(value)
+    return 1
+
+
+def get_size(step: list[Change]) -> int:
+    return sum(map(get_change_size, step))
+
+
+# Records the changes made to a song as steps that can be undone and redone.
+# Each change holds the note or track it applies to along with its old state,
+# so undoing a step never has to search or copy the song.
+class History:
+    undo_steps: deque[list[Change]]
+    redo_steps: deque[list[Change]]
+    step: list[Change]
+    size: int
+    recording: bool
+
+    def __init__(self):
+        self.undo_steps = deque()
+        self.redo_steps = deque()
+        self.step = []
+        self.size = 0
+        self.recording = True
+
+    def record(self, kind: int, target: Any, value: Any = None) -> None:
+        if not self.recording:
+            return
+        self.step.append((kind, target, value))
+        if len(self.redo_steps) > 0:
+            self.redo_steps.clear()
+
+    # Ends the current step, so that the next change starts a new one
+    def commit(self) -> None:
+        if len(self.step) == 0:
+            return
+        self.undo_steps.append(self.step)
+        self.size += get_size(self.step)
+        self.step = []
+        self.trim()
+
+    # Forgets the oldest steps until the history is within its limits
+    def trim(self) -> None:
+        while len(self.undo_steps) > 1 and (
+            len(self.undo_steps) > MAX_UNDO_STEPS
+            or self.size > MAX_UNDO_CHANGES
+        ):
+            self.size -= get_size(self.undo_steps.popleft())
+
+    def clear(self) -> None:
+        self.undo_steps.clear()
+        self.redo_steps.clear()
+        self.step = []
+        self.size = 0
+
+    def can_undo(self) -> bool:
+        return len(self.step) > 0 or len(self.undo_steps) > 0
+
+    def can_redo(self) -> bool:
+        return len(self.redo_steps) > 0
+
+    # Returns the number of changes undone
+    def undo(self, song: Song, player: Optional[Player] = None) -> int:
+        self.commit()
+        if len(self.undo_steps) == 0:
+            return 0
+        step = self.undo_steps.pop()
+        self.size -= get_size(step)
+        self.apply(song, reversed(step), True, player)
+        self.redo_steps.append(step)
+        return len(step)
+
+    def redo(self, song: Song, player: Optional[Player] = None) -> int:
+        self.commit()
+        if len(self.redo_steps) == 0:
+            return 0
+        step = self.redo_steps.pop()
+        self.apply(song, step, False, player)
+        self.undo_steps.append(step)
+        self.size += get_size(step)
+        self.trim()
+        return len(step)
+
+    def apply(
+        self,
+        song: Song,
+        step: Iterable[Change],
+        undo: bool,
+        player: Optional[Player],
+    ) -> None:
+        self.recording = False
+        try:
+            for kind, target, value in step:
+                if kind in (ADD, REMOVE):
+                    if (kind == ADD) == undo:
+                        song.remove_note(target)
+                    else:
+                        time, duration, number, velocity = value
+                        target.move(time)
+                        target.set_duration(duration)
+                        target.set_number(number)
+                        target.set_velocity(velocity)
+                        song.add_note(target)
+                elif kind in (TRACK_ADD, TRACK_REMOVE):
+                    if (kind == TRACK_ADD) == undo:
+                        song.delete_track(target)
+                    else:
+                        index, events = value
+                        song.insert_track(index, target, events, player)
+                elif kind == TRACK_CHANNEL:
+                    old, new = value
+                    song.set_track_channel(target, old if undo else new, player)
+                elif kind == TRACK_INSTRUMENT:
+                    old, new = value
+                    song.set_track_instrument(
+                        target, old if undo else new, player
+                    )
+                elif kind == MESSAGES_ADD:
+                    if undo:
+                        song.remove_messages(value)
+                    else:
+                        song.add_messages(value)
+        finally:
+            self.recording = True
+
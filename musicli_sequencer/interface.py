@@ -3,24 +3,36 @@ import curses
 import curses.ascii
 from enum import Enum
 from dataclasses import dataclass
-from math import inf
+from itertools import groupby
+from math import ceil, inf
+from operator import attrgetter
+import os.path
 import sys
-from typing import Optional, Union
+from threading import Thread
+from time import perf_counter
+from typing import Any, Callable, Optional, Union
 
+from .analysis import Analyzer
+from .midifile import ExportTrack, write_midi
 from .player import Player, PLAY_EVENT, RESTART_EVENT, KILL_EVENT
+from .project import PROJECT_EXTENSION, is_project, save_project
+from .recorder import Recorder
+from .stats import Stats
 
 from .song import (
     Note,
     Song,
     Track,
+    number_to_drum_name,
     number_to_name,
     CHORDS,
     COMMON_NAMES,
     DEFAULT_VELOCITY,
     DRUM_CHANNEL,
-    DRUM_NAMES,
-    DRUM_OFFSET,
+    DRUM_NOTE_NAMES,
+    IMPORT_MIDO,
     MAX_VELOCITY,
+    NOTE_NAMES,
     NOTES_PER_OCTAVE,
     TOTAL_INSTRUMENTS,
     TOTAL_NOTES,
@@ -44,10 +56,33 @@ PAIR_HIGHLIGHT = len(INSTRUMENT_PAIRS) + 10
 
 DEFAULT_OCTAVE = 4
 
+# A region of the screen as (left, top, right, bottom), excluding the right
+# column and bottom row
+Region = tuple[int, int, int, int]
+
+# Past this many damaged regions, the whole screen is redrawn instead
+MAX_REGIONS = 64
+
+# Larger selections are not previewed or named as a chord
+MAX_CHORD_NOTES = 16
+
+# The analysis lane shades each measure by how many of its notes are out of
+# the scale, and the summary draws the velocity histogram as a sparkline
+HEAT_CHARS = "·░▒▓█"
+ASCII_HEAT_CHARS = ".:+*#"
+SPARK_CHARS = "▁▂▃▄▅▆▇█"
+ASCII_SPARK_CHARS = "_.-=+*#@"
+
+# The screen is redrawn at most this often, and polled for input this often
+# during playback
+FRAME_SECONDS = 1 / 60
+POLL_MILLISECONDS = 100
+
 ERROR_FLUIDSYNTH = (
     "fluidsynth could not be imported, so playback is unavailable"
 )
 ERROR_MIDO = "mido could not be imported, so MIDI import/export is unavailable"
+ERROR_MIDI_INPUT = "No MIDI input port is open; use --midi-input to open one"
 
 
 class Action(Enum):
@@ -102,7 +137,28 @@ class Action(Enum):
     PLAYBACK_RESTART = "restart playback from the beginning of the song"
     PLAYBACK_CURSOR = "restart playback from the editing cursor"
     CURSOR_TO_PLAYHEAD = "sync the cursor location to the playhead"
+    RECORD_TOGGLE = "toggle recording from the MIDI input port into this track"
+    LOOP_TOGGLE = (
+        "loop playback from the mark to the cursor, or over this measure if "
+        "there is no mark, or stop looping"
+    )
+    SELECT_RANGE = (
+        "mark the start of a selection, or select the notes in this track "
+        "from the mark to the cursor"
+    )
+    SELECT_TRACK = "select every note in this track"
+    TRANSPOSE_DEC = "transpose the selected chord down a semitone"
+    TRANSPOSE_INC = "transpose the selected chord up a semitone"
+    QUANTIZE = "snap the start of each selected note to the nearest column"
+    UNDO = "undo the last change"
+    REDO = "redo the last undone change"
+    WRITE = "save song (as a project if the file name ends in .mcli)"
     WRITE_MIDI = "export song as a MIDI file"
+    MERGE_MIDI = "merge the tracks of a MIDI file into the song at the cursor"
+    ANALYSIS_TOGGLE = (
+        "show or hide this track's statistics and a lane shading each "
+        "measure by how many of its notes are out of the scale"
+    )
     QUIT_HELP = "does not quit; use Ctrl+C to exit MusiCLI"
 
 
@@ -166,12 +222,47 @@ KEYMAP: dict[int, Action] = {
     curses.ascii.LF: Action.PLAYBACK_RESTART,
     ord("g"): Action.PLAYBACK_CURSOR,
     ord("G"): Action.CURSOR_TO_PLAYHEAD,
-    ord("w"): Action.WRITE_MIDI,
+    ord("r"): Action.RECORD_TOGGLE,
+    ord("o"): Action.LOOP_TOGGLE,
+    ord("v"): Action.SELECT_RANGE,
+    ord("V"): Action.SELECT_TRACK,
+    ord("("): Action.TRANSPOSE_DEC,
+    ord(")"): Action.TRANSPOSE_INC,
+    ord("s"): Action.QUANTIZE,
+    ord("u"): Action.UNDO,
+    ord("U"): Action.REDO,
+    curses.ascii.DC2: Action.REDO,
+    ord("w"): Action.WRITE,
     ord("W"): Action.WRITE_MIDI,
+    ord("M"): Action.MERGE_MIDI,
+    ord("S"): Action.ANALYSIS_TOGGLE,
     ord("q"): Action.QUIT_HELP,
     ord("Q"): Action.QUIT_HELP,
 }
 
+# Actions that only move the view or the cursor are applied once with their
+# repeat count, rather than being repeated
+SCALED_ACTIONS = frozenset(
+    (
+        Action.EDIT_LEFT,
+        Action.EDIT_RIGHT,
+        Action.EDIT_UP,
+        Action.EDIT_DOWN,
+        Action.PAN_LEFT,
+        Action.PAN_LEFT_SHORT,
+        Action.PAN_RIGHT,
+        Action.PAN_RIGHT_SHORT,
+        Action.PAN_UP,
+        Action.PAN_UP_SHORT,
+        Action.PAN_DOWN,
+        Action.PAN_DOWN_SHORT,
+        Action.JUMP_LEFT,
+        Action.JUMP_RIGHT,
+        Action.JUMP_UP,
+        Action.JUMP_DOWN,
+    )
+)
+
 INSERT_KEYMAP: dict[str, int] = {
     "z": 0,  # C
     "s": 1,  # C#
@@ -219,6 +310,25 @@ SYMBOLS_TO_NUMBERS: dict[str, str] = {
 
 INSERT_KEYLIST = tuple(INSERT_KEYMAP.keys())
 
+# Columns taken up by the note names to the left of the notes
+SIDEBAR_WIDTH = 6
+DRUM_SIDEBAR_WIDTH = 9
+
+
+def format_sidebar_label(name: str, width: int) -> str:
+    return "  " + name.ljust(width - 2)
+
+
+# Every row of the sidebar is labeled from these, rather than formatting each
+# note's name as it is drawn
+SIDEBAR_LABELS = tuple(
+    format_sidebar_label(name, SIDEBAR_WIDTH) for name in NOTE_NAMES[True]
+)
+DRUM_SIDEBAR_LABELS = tuple(
+    format_sidebar_label(name, DRUM_SIDEBAR_WIDTH)
+    for name in DRUM_NOTE_NAMES[0]
+)
+
 
 def init_color_pairs() -> None:
     global COLOR_GRAY
@@ -247,6 +357,11 @@ def format_velocity(velocity: int) -> str:
     return f"Velocity: {velocity}"
 
 
+def format_time(seconds: float) -> str:
+    minutes, seconds = divmod(int(seconds), 60)
+    return f"{minutes}:{seconds:02}"
+
+
 def format_track(index: int, track: Track) -> str:
     return f"Track {index + 1}: {track.instrument_name}"
 
@@ -364,6 +479,19 @@ class StatusBlock(Block):
         return self.priority > other.priority
 
 
+# A line of text typed on the message line, which is passed to the submit
+# function once Enter is pressed
+@dataclass
+class Prompt:
+    label: str
+    submit: Callable[[str], None]
+    text: str = ""
+
+
+# The row, column, string and attribute of a string on the status bar
+StatusLine = tuple[int, int, str, int]
+
+
 class Interface:
     window: curses.window
     song: Song
@@ -378,12 +506,31 @@ class Interface:
     octave: int
     last_note: Optional[Note]
     last_chord: list[Note]
+    mark: Optional[int]
     message: str
     filename: Optional[str]
     unicode: bool
     highlight_track: bool
     focus_track: bool
     repeat_count: int
+    stats: Optional[Stats]
+    clip: Region
+    view: Optional[tuple]
+    drawn_selection: list[tuple[bool, int, int, int]]
+    drawn_cursor_x: Optional[int]
+    drawn_playhead_x: Optional[int]
+    export_thread: Optional[Thread]
+    export_filename: str
+    export_error: Optional[str]
+    recorder: Optional[Recorder]
+    prompt: Optional[Prompt]
+    chord_names: Optional[tuple[tuple, tuple[str, str]]]
+    status: Optional[tuple]
+    status_lines: list[StatusLine]
+    analyzer: Analyzer
+    show_analysis: bool
+    analysis_message: str
+    drawn_analysis_version: int
 
     def __init__(
         self,
@@ -392,6 +539,9 @@ class Interface:
         player: Optional[Player] = None,
         filename: Optional[str] = None,
         unicode: bool = True,
+        stats: Optional[Stats] = None,
+        recorder: Optional[Recorder] = None,
+        analysis_jobs: int = 1,
     ):
         self.window = window
         self.song = song
@@ -405,17 +555,38 @@ class Interface:
         self.octave = DEFAULT_OCTAVE
         self.last_note = None
         self.last_chord = []
+        self.mark = None
         self.message = ""
         self.filename = filename
         self.unicode = unicode
         self.highlight_track = False
         self.focus_track = False
         self.repeat_count = 0
+        self.stats = stats
+
+        self.clip = self.full_region
+        self.view = None
+        self.drawn_selection = []
+        self.drawn_cursor_x = None
+        self.drawn_playhead_x = None
+        self.export_thread = None
+        self.export_filename = ""
+        self.export_error = None
+        self.recorder = recorder
+        self.prompt = None
+        self.chord_names = None
+        self.status = None
+        self.status_lines = []
+        self.analyzer = Analyzer(analysis_jobs)
+        self.show_analysis = False
+        self.analysis_message = ""
+        self.drawn_analysis_version = 0
 
         self.x_offset = self.min_x_offset
         self.y_offset = (
             DEFAULT_OCTAVE + 1
         ) * NOTES_PER_OCTAVE - self.height // 2
+        self.restore_view_state(self.song.view_state)
 
         init_color_pairs()
 
@@ -427,9 +598,13 @@ class Interface:
     def height(self) -> int:
         return self.window.getmaxyx()[0]
 
+    @property
+    def full_region(self) -> Region:
+        return 0, 0, self.width - 1, self.height
+
     @property
     def x_sidebar_offset(self) -> int:
-        return -9 if self.track.is_drum else -6
+        return -DRUM_SIDEBAR_WIDTH if self.track.is_drum else -SIDEBAR_WIDTH
 
     @property
     def min_x_offset(self) -> int:
@@ -457,26 +632,43 @@ class Interface:
     def instrument(self) -> int:
         return self.track.instrument
 
+    # Draws a string, clipped to the region currently being drawn
+    def addstr(self, y: int, x: int, string: str, attr: int) -> None:
+        left, top, right, bottom = self.clip
+        if not top <= y < bottom or x >= right:
+            return
+        if x < left:
+            string = string[left - x :]
+            x = left
+        string = string[: right - x]
+        if len(string) > 0:
+            self.window.addstr(y, x, string, attr)
+
     def draw_line(
         self, x: int, string: str, attr: int, start_y: int = 1
     ) -> None:
-        if 0 <= x and x + len(string) < self.width:
-            for y in range(start_y, self.height):
-                self.window.addstr(y, x, string, attr)
+        left, top, right, bottom = self.clip
+        if 0 <= x and x + len(string) < self.width and left <= x < right:
+            for y in range(max(start_y, top), min(self.height, bottom)):
+                self.addstr(y, x, string, attr)
 
     def draw_scale_dots(self) -> None:
+        left, top, right, bottom = self.clip
         string = "·" if self.unicode else "."
         attr = curses.color_pair(PAIR_LINE)
+        semitones = [
+            (number + self.song.key) % NOTES_PER_OCTAVE
+            for number in self.song.scale
+        ]
+        start_x = left + (-self.x_offset - left) % 4
         for y, note in enumerate(
             range(self.y_offset, self.y_offset + self.height - 1)
         ):
-            semitone = note % NOTES_PER_OCTAVE
-            if semitone in [
-                (number + self.song.key) % NOTES_PER_OCTAVE
-                for number in self.song.scale
-            ]:
-                for x in range(-self.x_offset % 4, self.width - 1, 4):
-                    self.window.addstr(self.height - y - 1, x, string, attr)
+            if not top <= self.height - y - 1 < bottom:
+                continue
+            if note % NOTES_PER_OCTAVE in semitones:
+                for x in range(start_x, min(right, self.width - 1), 4):
+                    self.addstr(self.height - y - 1, x, string, attr)
 
     def draw_measures(self) -> None:
         cols_per_measure = self.song.cols_per_beat * self.song.beats_per_measure
@@ -487,11 +679,11 @@ class Interface:
         ):
             self.draw_line(x, string, attr, start_y=0)
             measure_number = (x + self.x_offset) // cols_per_measure + 1
-            self.window.addstr(0, x, str(measure_number), attr)
+            self.addstr(0, x, str(measure_number), attr)
 
     def draw_cursor(self) -> None:
         self.draw_line(
-            self.song.ticks_to_cols(self.time) - self.x_offset,
+            self.cursor_x,
             "▏" if self.unicode else "|",
             curses.color_pair(0),
         )
@@ -499,39 +691,38 @@ class Interface:
     def draw_playhead(self) -> None:
         if self.player is not None:
             self.draw_line(
-                self.song.ticks_to_cols(self.player.playhead) - self.x_offset,
+                self.playhead_x,
                 "▏" if self.unicode else "|",
                 curses.color_pair(PAIR_PLAYHEAD),
             )
 
     def draw_notes(self) -> None:
-        time = self.song.cols_to_ticks(self.x_offset)
-        index = self.song.get_next_index(time)
+        left, top, right, bottom = self.clip
+        notes = self.song.get_notes_in_range(
+            self.song.cols_to_ticks(self.x_offset + left),
+            self.song.cols_to_ticks(self.x_offset + right),
+            self.track if self.focus_track else None,
+            low=self.height - bottom + self.y_offset,
+            high=self.height - max(top, 1) - 1 + self.y_offset,
+        )
+        # Notes are drawn in the same order no matter which region is drawn,
+        # so that overlapping notes look the same either way
+        notes.sort(key=attrgetter("sort_key"))
         string = "▏" if self.unicode else "["
-        for note in self.song.events[index:]:
-            if not isinstance(note, Note):
-                continue
-
-            if self.focus_track and note.track is not self.track:
-                continue
-
+        chord_ids = {id(note) for note in self.last_chord}
+        for note in notes:
             start_x = self.song.ticks_to_cols(note.start) - self.x_offset
             end_x = self.song.ticks_to_cols(note.end) - self.x_offset
             if start_x >= self.width - 1:
-                if note.on:
-                    break
                 continue
 
             y = self.height - (note.number - self.y_offset) - 1
-            if not 0 < y < self.height:
-                continue
-
-            if not note.on and start_x >= 0:
+            if not 0 < y < self.height or not top <= y < bottom:
                 continue
 
             if note.on_pair is self.last_note:
                 color_pair = PAIR_LAST_NOTE
-            elif note.on_pair in self.last_chord:
+            elif id(note.on_pair) in chord_ids:
                 color_pair = PAIR_LAST_CHORD
             elif self.highlight_track and note.track is self.track:
                 color_pair = PAIR_HIGHLIGHT
@@ -545,50 +736,123 @@ class Interface:
 
             attr = curses.color_pair(color_pair)
 
-            for x in range(max(start_x, 0), min(end_x, self.width - 1)):
-                self.window.addstr(y, x, " ", attr)
+            fill_start = max(start_x, left)
+            fill_end = min(end_x, right, self.width - 1)
+            if fill_start < fill_end:
+                self.addstr(y, fill_start, " " * (fill_end - fill_start), attr)
 
             if 0 <= start_x < self.width - 1:
-                self.window.addstr(y, start_x, string, attr)
+                self.addstr(y, start_x, string, attr)
 
             note_width = end_x - start_x
             if note_width >= 4 and 0 <= start_x + 1:
                 string_width = min(self.width, end_x) - start_x - 2
-                self.window.addstr(
-                    y, start_x + 1, note.name[:string_width], attr
-                )
+                self.addstr(y, start_x + 1, note.name[:string_width], attr)
 
     def draw_sidebar(self) -> None:
+        left, top, right, bottom = self.clip
+        if left >= -self.x_sidebar_offset:
+            return
         pair_note = curses.color_pair(PAIR_SIDEBAR_NOTE)
         pair_key = curses.color_pair(PAIR_SIDEBAR_KEY)
+        is_drum = self.track.is_drum
+        labels = DRUM_SIDEBAR_LABELS if is_drum else SIDEBAR_LABELS
         for y, number in enumerate(
             range(self.y_offset, self.y_offset + self.height)
         ):
-            if self.track.is_drum:
-                drum_number = number - DRUM_OFFSET
-                if 0 <= drum_number < len(DRUM_NAMES):
-                    note_name, _ = DRUM_NAMES[drum_number]
-                else:
-                    note_name = str(number)
+            if not top <= self.height - y - 1 < bottom:
+                continue
+            if 0 <= number < len(labels):
+                label = labels[number]
             else:
-                note_name = number_to_name(number)
-            self.window.addstr(
-                self.height - y - 1,
-                0,
-                "  " + note_name.ljust(-self.x_sidebar_offset - 2),
-                pair_note,
-            )
+                label = format_sidebar_label(
+                    (
+                        number_to_drum_name(number)
+                        if is_drum
+                        else number_to_name(number)
+                    ),
+                    -self.x_sidebar_offset,
+                )
+            self.addstr(self.height - y - 1, 0, label, pair_note)
 
             insert_key = number - self.octave * NOTES_PER_OCTAVE
-            if 0 <= insert_key < len(INSERT_KEYMAP):
-                self.window.addstr(
+            if 0 <= insert_key < len(INSERT_KEYLIST):
+                self.addstr(
                     self.height - y - 1,
                     0,
-                    list(INSERT_KEYMAP.keys())[insert_key],
+                    INSERT_KEYLIST[insert_key],
                     pair_key,
                 )
 
-    def draw_status_block(self, x: int, block, length: int) -> int:
+    @property
+    def analysis_y(self) -> int:
+        return self.height - 3
+
+    # Measures are shaded from the scale dot when every note is in the scale
+    # to a full block when none are
+    def draw_analysis(self) -> None:
+        left, top, right, bottom = self.clip
+        y = self.analysis_y
+        window = self.analyzer.window
+        if not self.show_analysis or window is None or not top <= y < bottom:
+            return
+        results = self.analyzer.get_results(self.track)
+        heat = HEAT_CHARS if self.unicode else ASCII_HEAT_CHARS
+        attr = curses.color_pair(PAIR_LINE)
+        sidebar_width = -self.x_sidebar_offset
+        # Each window is a measure, so it is drawn as a run of columns
+        cols_per_measure = self.song.cols_per_beat * self.song.beats_per_measure
+        start_x = max(left, sidebar_width)
+        end_x = min(right, self.width - 1)
+        cells = []
+        x = start_x
+        while x < end_x:
+            index = (x + self.x_offset) // cols_per_measure
+            next_x = min((index + 1) * cols_per_measure - self.x_offset, end_x)
+            stats = results.get(index)
+            if stats is None:
+                string = " "
+            else:
+                share = stats.out_of_scale / stats.notes
+                string = heat[ceil(share * (len(heat) - 1))]
+            cells.append(string * (next_x - x))
+            x = next_x
+        self.addstr(y, start_x, "".join(cells), attr)
+        if left < sidebar_width:
+            self.addstr(
+                y,
+                0,
+                format_sidebar_label("Scale", sidebar_width),
+                curses.color_pair(PAIR_SIDEBAR_NOTE),
+            )
+
+    def get_analysis_summary(self) -> str:
+        if not self.analyzer.ready:
+            return "Analyzing..."
+        stats = self.analyzer.get_summary(self.track)
+        if stats is None:
+            return "No notes in this track"
+        spark = SPARK_CHARS if self.unicode else ASCII_SPARK_CHARS
+        peak = max(stats.velocities)
+        velocities = "".join(
+            spark[round(count / peak * (len(spark) - 1))]
+            for count in stats.velocities
+        )
+        measures = len(self.analyzer.get_results(self.track))
+        summary = (
+            f"{stats.notes} notes in {measures} measures, "
+            f"{number_to_name(stats.low)}-{number_to_name(stats.high)}, "
+        )
+        if not self.track.is_drum:
+            summary += (
+                f"{stats.out_of_scale} out of "
+                f"{self.key} {self.song.scale_name.replace('_', ' ')}, "
+            )
+        return summary + f"velocity {velocities}"
+
+    def layout_status_block(
+        self, x: int, block, length: int, lines: list[StatusLine]
+    ) -> int:
         if isinstance(block, FillerBlock):
             filler_width = self.width - length - 1
             string = " " * filler_width
@@ -598,30 +862,97 @@ class Interface:
             new_x = x + len(block)
 
         if len(string) > 0:
-            self.window.addstr(self.height - 2, x, string, block.attr)
+            lines.append((self.height - 2, x, string, block.attr))
         return new_x
 
+    def get_chord_names(self) -> tuple[str, str]:
+        chord = tuple(
+            (note.number, note.is_drum, note.velocity)
+            for note in self.last_chord
+        )
+        if self.chord_names is None or self.chord_names[0] != chord:
+            self.chord_names = chord, format_notes(self.last_chord)
+        return self.chord_names[1]
+
+    # Everything shown on the status bar and the message line below it
+    def get_status(self) -> tuple:
+        end_measure = (
+            self.song.ticks_to_beats(self.song.end)
+            // self.song.beats_per_measure
+        )
+        if self.player is not None:
+            playhead = self.player.playhead
+            play = (
+                self.song.ticks_to_beats(playhead)
+                // self.song.beats_per_measure,
+                int(self.song.ticks_to_seconds(playhead)),
+                int(self.song.ticks_to_seconds(self.song.end)),
+                self.player.loop is not None,
+                self.player.loaded.is_set(),
+            )
+        else:
+            play = None
+        return (
+            self.window.getmaxyx(),
+            self.message,
+            self.repeat_count,
+            self.insert,
+            self.filename,
+            str(self.stats) if self.stats is not None else None,
+            self.song.key,
+            self.song.scale_name,
+            self.focus_track,
+            self.recording,
+            self.track_index,
+            len(self.song.tracks),
+            self.track.instrument_name,
+            end_measure,
+            play,
+            self.song.ticks_to_beats(self.time) // self.song.beats_per_measure,
+        )
+
+    # The status bar is only laid out again when something shown on it has
+    # changed, so that most frames only draw the strings from the last layout
     def draw_status_bar(self) -> None:
-        if len(self.message) == 0 and len(self.last_chord) > 0:
-            short_notes, long_notes = format_notes(self.last_chord)
+        if self.prompt is not None:
+            self.message = self.prompt.label + self.prompt.text
+        elif len(self.message) == 0 and len(self.last_chord) > MAX_CHORD_NOTES:
+            self.message = f"{len(self.last_chord)} notes selected"
+        elif len(self.message) == 0 and len(self.last_chord) > 0:
+            short_notes, long_notes = self.get_chord_names()
             self.message = (
                 long_notes if len(long_notes) < self.width else short_notes
             )
-
-        self.window.addstr(
-            self.height - 1,
-            0,
-            self.message.ljust(self.width - 1)[: self.width - 1],
-            curses.color_pair(0),
-        )
+        elif self.show_analysis and self.message in ("", self.analysis_message):
+            self.analysis_message = self.get_analysis_summary()
+            self.message = self.analysis_message
+
+        status = self.get_status()
+        if status != self.status:
+            self.status = status
+            self.status_lines = self.layout_status_bar()
+        for y, x, string, attr in self.status_lines:
+            self.addstr(y, x, string, attr)
+
+    def layout_status_bar(self) -> list[StatusLine]:
+        lines: list[StatusLine] = [
+            (
+                self.height - 1,
+                0,
+                self.message.ljust(self.width - 1)[: self.width - 1],
+                curses.color_pair(0),
+            )
+        ]
 
         if self.repeat_count > 0:
             repeat_string = str(self.repeat_count)
-            self.window.addstr(
-                self.height - 1,
-                max(self.width - len(repeat_string) - 1, 0),
-                repeat_string[: self.width],
-                curses.color_pair(0),
+            lines.append(
+                (
+                    self.height - 1,
+                    max(self.width - len(repeat_string) - 1, 0),
+                    repeat_string[: self.width],
+                    curses.color_pair(0),
+                )
             )
 
         bar: list[Block] = []
@@ -654,6 +985,16 @@ class Interface:
             )
         )
 
+        if self.stats is not None:
+            bar.append(
+                StatusBlock(
+                    str(self.stats),
+                    f"{self.stats.draw.name} {self.stats.draw.summary} ms",
+                    attr=color | curses.A_REVERSE,
+                    priority=0,
+                )
+            )
+
         bar.append(FillerBlock(attr=color | curses.A_REVERSE))
 
         key_name = self.song.key_name
@@ -674,6 +1015,30 @@ class Interface:
                 )
             )
 
+        if self.player is not None and self.player.loop is not None:
+            bar.append(
+                StatusBlock(
+                    "LOOP", "O", attr=color | curses.A_BOLD, priority=3
+                )
+            )
+
+        if self.recording:
+            bar.append(
+                StatusBlock(
+                    "RECORDING", "R", attr=color | curses.A_BOLD, priority=3
+                )
+            )
+
+        if self.player is not None and not self.player.loaded.is_set():
+            bar.append(
+                StatusBlock(
+                    "LOADING SOUNDFONT",
+                    "L",
+                    attr=color | curses.A_BOLD,
+                    priority=3,
+                )
+            )
+
         track_number_text = f"T{self.track_index + 1}/{len(self.song.tracks)}"
         bar.append(
             StatusBlock(
@@ -696,10 +1061,21 @@ class Interface:
                 + 1
             )
             play_text = f"P{play_measure}/{end_measure}"
+            play_time = format_time(
+                self.song.ticks_to_seconds(self.player.playhead)
+            )
+            end_time = format_time(self.song.ticks_to_seconds(self.song.end))
+            play_time_text = f"{play_text} ({play_time}/{end_time})"
         else:
             play_text = ""
+            play_time_text = ""
         bar.append(
-            StatusBlock(play_text, attr=color | curses.A_BOLD, priority=5)
+            StatusBlock(
+                play_time_text,
+                play_text,
+                attr=color | curses.A_BOLD,
+                priority=5,
+            )
         )
 
         edit_measure = (
@@ -726,50 +1102,183 @@ class Interface:
 
         x = 0
         for block in bar:
-            x = self.draw_status_block(x, block, length)
+            x = self.layout_status_block(x, block, length, lines)
             if x >= self.width:
-                return
+                break
+        return lines
+
+    @property
+    def cursor_x(self) -> int:
+        return self.song.ticks_to_cols(self.time) - self.x_offset
+
+    @property
+    def playhead_x(self) -> Optional[int]:
+        if self.player is None:
+            return None
+        return self.song.ticks_to_cols(self.player.playhead) - self.x_offset
+
+    # Everything that affects how the whole screen is drawn
+    def get_view(self) -> tuple:
+        return (
+            self.window.getmaxyx(),
+            self.x_offset,
+            self.y_offset,
+            self.track_index,
+            self.octave,
+            self.highlight_track,
+            self.focus_track,
+            self.show_analysis,
+            self.song.key,
+            self.song.scale_name,
+            self.song.cols_per_beat,
+            self.song.beats_per_measure,
+            tuple(
+                (track.channel, track.instrument) for track in self.song.tracks
+            ),
+        )
+
+    def get_selection(self) -> list[tuple[bool, int, int, int]]:
+        notes = [self.last_note] if self.last_note is not None else []
+        notes.extend(self.last_chord)
+        return [
+            (note is self.last_note, note.start, note.end, note.number)
+            for note in notes
+            if note.pair is not None
+        ]
+
+    def note_region(self, start: int, end: int, number: int) -> Region:
+        y = self.height - (number - self.y_offset) - 1
+        return (
+            self.song.ticks_to_cols(start) - self.x_offset,
+            y,
+            self.song.ticks_to_cols(end) - self.x_offset + 1,
+            y + 1,
+        )
+
+    def column_region(self, x: int) -> Region:
+        return x, 0, x + 1, self.height
+
+    # Returns the regions of the screen that have changed since the last draw,
+    # or None if the whole screen needs to be redrawn
+    def get_damage(self) -> Optional[list[Region]]:
+        view = self.get_view()
+        changes = self.song.pop_changes()
+        self.analyzer.invalidate(self.song, changes)
+        analysis_version = self.analyzer.version
+        selection = self.get_selection()
+        cursor_x = self.cursor_x
+        playhead_x = self.playhead_x
+
+        regions: Optional[list[Region]] = []
+        if view != self.view or changes is None:
+            regions = None
+        else:
+            for start, end, number in changes:
+                regions.append(self.note_region(start, end, number))
+            if selection != self.drawn_selection:
+                for _, start, end, number in self.drawn_selection + selection:
+                    regions.append(self.note_region(start, end, number))
+            for old_x, new_x in (
+                (self.drawn_cursor_x, cursor_x),
+                (self.drawn_playhead_x, playhead_x),
+            ):
+                if old_x != new_x:
+                    for x in (old_x, new_x):
+                        if x is not None:
+                            regions.append(self.column_region(x))
+            if self.show_analysis and (
+                analysis_version != self.drawn_analysis_version
+            ):
+                regions.append(
+                    (0, self.analysis_y, self.width, self.analysis_y + 1)
+                )
+            if len(regions) > MAX_REGIONS:
+                regions = None
+
+        self.view = view
+        self.drawn_selection = selection
+        self.drawn_cursor_x = cursor_x
+        self.drawn_playhead_x = playhead_x
+        self.drawn_analysis_version = analysis_version
+        return regions
+
+    def draw_region(self, region: Region, clear: bool = True) -> None:
+        left, top, right, bottom = region
+        self.clip = (
+            max(left, 0),
+            max(top, 0),
+            min(right, self.width - 1),
+            min(bottom, self.height),
+        )
+        left, top, right, bottom = self.clip
+        if left >= right or top >= bottom:
+            return
+
+        if clear:
+            for y in range(top, bottom):
+                self.window.addstr(
+                    y, left, " " * (right - left), curses.color_pair(0)
+                )
 
-    def draw(self) -> None:
         self.draw_scale_dots()
         self.draw_measures()
         self.draw_cursor()
         self.draw_playhead()
         self.draw_notes()
         self.draw_sidebar()
+        self.draw_analysis()
+
+    # Only the parts of the screen that have changed are drawn again, except
+    # for the status bar, which is always drawn
+    def draw(self) -> None:
+        regions = self.get_damage()
+        if regions is None:
+            self.window.erase()
+            self.draw_region(self.full_region, clear=False)
+        else:
+            for region in regions:
+                self.draw_region(region)
+            self.draw_region((0, self.height - 2, self.width - 1, self.height))
+
+        self.clip = self.full_region
         self.draw_status_bar()
 
+    # Notes can only be previewed while playback is stopped
+    @property
+    def can_preview(self) -> bool:
+        return (
+            self.player is not None
+            and self.player.ready
+            and not self.player.playing
+        )
+
     def play_note(self, note: Optional[Note] = None) -> None:
         if note is None:
             note = self.last_note
-        if (
-            note is not None
-            and self.player is not None
-            and not self.player.playing
-        ):
+        if note is not None and self.can_preview:
+            assert self.player is not None
             self.player.play_note(note)
 
     def stop_note(self, note: Optional[Note] = None) -> None:
         if note is None:
             note = self.last_note
-        if (
-            note is not None
-            and self.player is not None
-            and not self.player.playing
-        ):
+        if note is not None and self.can_preview:
+            assert self.player is not None
             self.player.stop_note(note)
 
     def play_notes(self, notes: Optional[list[Note]] = None) -> None:
         if notes is None:
-            notes = self.last_chord
-        if self.player is not None and not self.player.playing:
+            notes = self.last_chord[:MAX_CHORD_NOTES]
+        if self.can_preview:
+            assert self.player is not None
             for note in notes:
                 self.player.play_note(note)
 
     def stop_notes(self, notes: Optional[list[Note]] = None):
         if notes is None:
-            notes = self.last_chord
-        if self.player is not None and not self.player.playing:
+            notes = self.last_chord[:MAX_CHORD_NOTES]
+        if self.can_preview:
+            assert self.player is not None
             for note in notes:
                 self.player.stop_note(note)
 
@@ -829,7 +1338,13 @@ class Interface:
         if not PLAY_EVENT.is_set():
             self.play_notes()
 
-    def move_cursor(self, left: bool) -> None:
+    # The view only follows the cursor once it has moved every step
+    def move_cursor(self, left: bool, count: int = 1) -> None:
+        for _ in range(count):
+            self.step_cursor(left)
+        self.snap_to_time()
+
+    def step_cursor(self, left: bool) -> None:
         nearest_time: Union[int, float]
         if left:
             nearest_chord = self.song.get_previous_chord(self.time, self.track)
@@ -872,19 +1387,25 @@ class Interface:
             self.last_note = nearest_chord[0]
             self.duration = self.last_note.duration
 
-        self.snap_to_time()
-
-    def set_octave(self, increase: bool) -> None:
+    def set_octave(self, increase: bool, count: int = 1) -> None:
         if increase:
             self.octave = min(
-                self.octave + 1, TOTAL_NOTES // NOTES_PER_OCTAVE - 1
+                self.octave + count, TOTAL_NOTES // NOTES_PER_OCTAVE - 1
             )
         else:
-            self.octave = max(self.octave - 1, 0)
+            self.octave = max(self.octave - count, 0)
         self.set_y_offset(
             (self.octave + 1) * NOTES_PER_OCTAVE - self.height // 2
         )
 
+    # Changes every note of the selected chord, or none of them if any would
+    # end up on top of the same note
+    def edit_chord(self, edit: Callable[[Note], None]) -> None:
+        try:
+            self.song.edit_notes(self.last_chord, edit)
+        except ValueError as e:
+            self.message = str(e)
+
     def set_time(self, increase: bool, chord: bool) -> None:
         if self.last_note is None:
             return
@@ -906,8 +1427,13 @@ class Interface:
                 new_start = max(
                     self.last_note.start - self.song.cols_to_ticks(1), 0
                 )
-            for note in self.last_chord:
-                self.song.move_note(note, new_start)
+            # Notes keep their distance from each other, and the earliest
+            # selected note stops at the start of the song
+            delta = max(
+                new_start - self.last_note.start,
+                -min(note.start for note in self.last_chord),
+            )
+            self.edit_chord(lambda note: note.move(note.start + delta))
             self.time = self.last_note.start
 
         self.snap_to_time()
@@ -930,20 +1456,17 @@ class Interface:
                         ),
                     )
             else:
+                step = self.song.cols_to_ticks(1)
                 if increase:
-                    for note in self.last_chord:
-                        self.song.set_duration(
-                            note, note.duration + self.song.cols_to_ticks(1)
-                        )
+                    self.edit_chord(
+                        lambda note: note.set_duration(note.duration + step)
+                    )
                 else:
-                    for note in self.last_chord:
-                        self.song.set_duration(
-                            note,
-                            max(
-                                note.duration - self.song.cols_to_ticks(1),
-                                self.song.cols_to_ticks(1),
-                            ),
+                    self.edit_chord(
+                        lambda note: note.set_duration(
+                            max(note.duration - step, step)
                         )
+                    )
 
             # Update duration and time for next insertion
             self.duration = self.last_note.duration
@@ -958,7 +1481,7 @@ class Interface:
 
     def set_velocity(self, increase: bool, chord: bool) -> None:
         if increase:
-            self.velocity = min(self.velocity + 1, MAX_VELOCITY - 1)
+            self.velocity = min(self.velocity + 1, MAX_VELOCITY)
         else:
             self.velocity = max(self.velocity - 1, 0)
 
@@ -966,10 +1489,10 @@ class Interface:
 
         if not chord:
             if self.last_note is not None:
-                self.last_note.set_velocity(self.velocity)
+                self.song.set_velocity(self.last_note, self.velocity)
         else:
             for note in self.last_chord:
-                note.set_velocity(self.velocity)
+                self.song.set_velocity(note, self.velocity)
 
     def set_track(self, increase: bool) -> None:
         old_x_sidebar_offset = self.x_sidebar_offset
@@ -993,7 +1516,7 @@ class Interface:
             instrument -= 1
         instrument %= TOTAL_INSTRUMENTS
 
-        self.track.set_instrument(instrument, self.player)
+        self.song.set_track_instrument(self.track, instrument, self.player)
 
         self.message = format_track(self.track_index, self.track)
 
@@ -1004,13 +1527,15 @@ class Interface:
 
         old_x_sidebar_offset = self.x_sidebar_offset
         if self.track.is_drum:
-            self.track.set_channel(self.song.get_open_channel(), self.player)
+            self.song.set_track_channel(
+                self.track, self.song.get_open_channel(), self.player
+            )
         else:
             for index, track in enumerate(self.song.tracks):
                 if track.is_drum:
                     self.message = f"Track {index + 1} is already a drum track"
                     return
-            self.track.set_channel(DRUM_CHANNEL, self.player)
+            self.song.set_track_channel(self.track, DRUM_CHANNEL, self.player)
         self.x_offset += self.x_sidebar_offset - old_x_sidebar_offset
 
         self.message = format_track(self.track_index, self.track)
@@ -1023,8 +1548,7 @@ class Interface:
                 self.stop_note(self.last_note)
 
             if chord:
-                for note in self.last_chord:
-                    self.song.remove_note(note)
+                self.song.remove_notes(self.last_chord)
                 self.last_chord = []
                 self.last_note = None
             else:
@@ -1039,6 +1563,53 @@ class Interface:
             self.last_chord = []
             self.move_cursor(left=True)
 
+    def select_range(self) -> None:
+        if self.mark is None:
+            self.mark = self.time
+            self.message = "Move the cursor and press v again to select"
+            return
+        start = min(self.mark, self.time)
+        end = max(self.mark, self.time) + self.song.cols_to_ticks(1)
+        self.mark = None
+        self.select(
+            self.song.get_notes_starting_between(start, end, self.track)
+        )
+
+    def select_track(self) -> None:
+        self.mark = None
+        self.select(self.song.get_notes_starting_between(0, track=self.track))
+
+    def select(self, notes: list[Note]) -> None:
+        self.stop_notes()
+        if len(notes) == 0:
+            self.deselect()
+            self.message = "No notes to select"
+            return
+        self.last_chord = notes
+        self.last_note = notes[0]
+
+    def transpose(self, increase: bool) -> None:
+        if self.last_note is None:
+            return
+        step = 1 if increase else -1
+        if not all(
+            0 <= note.number + step <= TOTAL_NOTES for note in self.last_chord
+        ):
+            self.message = "Notes would be out of range 0-127"
+            return
+        self.stop_notes()
+        self.edit_chord(lambda note: note.set_number(note.number + step))
+
+    def quantize(self) -> None:
+        if self.last_note is None:
+            return
+        step = self.song.cols_to_ticks(1)
+        # Notes halfway between columns always snap to the later one
+        self.edit_chord(
+            lambda note: note.move((note.start + step // 2) // step * step)
+        )
+        self.time = self.last_note.start
+
     def create_track(self) -> None:
         track = self.song.create_track(
             instrument=self.instrument, player=self.player
@@ -1059,29 +1630,146 @@ class Interface:
             self.message = format_track(self.track_index, self.track)
             self.highlight_track = True
 
-    def toggle_playback(self) -> None:
+    # Playback can be started while the soundfont is loading, in which case it
+    # begins once loading finishes
+    def check_playback(self) -> bool:
         if self.player is None:
             self.message = ERROR_FLUIDSYNTH
+            return False
+        if self.player.error is not None:
+            self.message = self.player.error
+            return False
+        if not self.player.loaded.is_set():
+            self.message = "Playback will start once the soundfont is loaded"
+        return True
+
+    def toggle_playback(self) -> None:
+        if not self.check_playback():
             return
 
         if PLAY_EVENT.is_set():
             PLAY_EVENT.clear()
-            curses.cbreak()
         else:
             self.stop_notes()
             PLAY_EVENT.set()
-            curses.halfdelay(1)
 
     def restart_playback(self, restart_time: int = 0) -> None:
-        if self.player is None:
-            self.message = ERROR_FLUIDSYNTH
+        if not self.check_playback():
             return
+        assert self.player is not None
 
         self.stop_notes()
         self.player.restart_time = restart_time
         RESTART_EVENT.set()
         PLAY_EVENT.set()
-        curses.halfdelay(1)
+
+    # The summary of the current track is shown on the message line while the
+    # lane is shown, once nothing else is
+    def toggle_analysis(self) -> None:
+        self.show_analysis = not self.show_analysis
+        if not self.show_analysis:
+            self.message = "Hid analysis"
+
+    # The loop can be changed during playback, which continues from the start
+    # of the new loop if the playhead is outside of it
+    def toggle_loop(self) -> None:
+        if not self.check_playback():
+            return
+        assert self.player is not None
+
+        if self.player.loop is not None:
+            self.player.loop = None
+            self.message = "Stopped looping"
+            return
+
+        if self.mark is not None:
+            start = min(self.mark, self.time)
+            end = max(self.mark, self.time) + self.song.cols_to_ticks(1)
+            self.mark = None
+        else:
+            measure = self.song.beats_to_ticks(self.song.beats_per_measure)
+            start = self.time - self.time % measure
+            end = start + measure
+        self.player.loop = start, end
+        start_measure = (
+            self.song.ticks_to_beats(start) // self.song.beats_per_measure + 1
+        )
+        end_measure = (
+            self.song.ticks_to_beats(end - 1) // self.song.beats_per_measure
+            + 1
+        )
+        if start_measure == end_measure:
+            self.message = f"Looping measure {start_measure}"
+        else:
+            self.message = f"Looping measures {start_measure}-{end_measure}"
+
+    def start_merge(self) -> None:
+        if not IMPORT_MIDO:
+            self.message = ERROR_MIDO
+            return
+        self.prompt = Prompt("Merge MIDI file: ", self.merge_midi)
+
+    # The file's tracks are added after the song's, starting at the cursor,
+    # and the whole merge is undone together
+    def merge_midi(self, path: str) -> None:
+        path = os.path.expanduser(path.strip())
+        if len(path) == 0:
+            return
+        try:
+            tracks = self.song.merge_midi(path, self.time, self.player)
+        except (OSError, EOFError, ValueError) as e:
+            self.message = f"Could not merge {path}: {e}"
+            return
+        self.message = f"Merged {len(tracks)} tracks from {path}"
+
+    @property
+    def recording(self) -> bool:
+        return self.recorder is not None and self.recorder.recording
+
+    # Recording plays the song while notes from the MIDI input port are added
+    # to the current track. Each take is a single step in the history.
+    def toggle_recording(self) -> None:
+        if self.recorder is None:
+            self.message = ERROR_MIDI_INPUT
+            return
+        if self.recording:
+            self.stop_recording()
+            return
+        if not self.check_playback():
+            return
+
+        self.song.history.commit()
+        self.recorder.channel = self.track.channel
+        self.recorder.recording = True
+        if not PLAY_EVENT.is_set():
+            self.stop_notes()
+            PLAY_EVENT.set()
+        self.message = f"Recording from {self.recorder.name}"
+
+    def stop_recording(self) -> None:
+        assert self.recorder is not None and self.player is not None
+        self.recorder.recording = False
+        self.recorder.merge(
+            self.song, self.track, self.player.get_tick(perf_counter())
+        )
+        self.song.history.commit()
+        self.message = f"Stopped recording from {self.recorder.name}"
+        if self.recorder.dropped > 0:
+            self.message += f" ({self.recorder.dropped} notes dropped)"
+            self.recorder.dropped = 0
+
+    # Returns whether any recorded notes were added to the song
+    def merge_recording(self) -> bool:
+        if self.recorder is None:
+            return False
+        # Notes are played on the current track's channel, even if it changed
+        self.recorder.channel = self.track.channel
+        if not self.recorder.recording:
+            return False
+        if not PLAY_EVENT.is_set():
+            self.stop_recording()
+            return True
+        return len(self.recorder.merge(self.song, self.track)) > 0
 
     def cursor_to_playhead(self) -> None:
         if self.player is None:
@@ -1090,13 +1778,124 @@ class Interface:
         self.time = self.player.playhead
         self.snap_to_time()
 
+    # The editor state that is saved in project files
+    @property
+    def view_state(self) -> dict[str, Any]:
+        return {
+            "time": self.time,
+            "duration": self.duration,
+            "velocity": self.velocity,
+            "track_index": self.track_index,
+            "octave": self.octave,
+            "x_offset": self.x_offset,
+            "y_offset": self.y_offset,
+        }
+
+    def restore_view_state(self, state: dict[str, Any]) -> None:
+        self.time = state.get("time", self.time)
+        self.duration = state.get("duration", self.duration)
+        self.velocity = state.get("velocity", self.velocity)
+        track_index = state.get("track_index", self.track_index)
+        if 0 <= track_index < len(self.song.tracks):
+            self.track_index = track_index
+        self.octave = state.get("octave", self.octave)
+        self.set_x_offset(state.get("x_offset", self.x_offset))
+        self.set_y_offset(state.get("y_offset", self.y_offset))
+
+    # The selected notes may no longer be in the song afterwards, so they are
+    # deselected first
+    def undo(self, redo: bool = False) -> None:
+        self.stop_notes()
+        self.deselect()
+        history = self.song.history
+        if redo:
+            count = history.redo(self.song, self.player)
+        else:
+            count = history.undo(self.song, self.player)
+        self.track_index = min(self.track_index, len(self.song.tracks) - 1)
+        if count == 0:
+            self.message = f"Nothing to {'redo' if redo else 'undo'}"
+        else:
+            verb = "Redid" if redo else "Undid"
+            self.message = f"{verb} {count} change{'s' if count > 1 else ''}"
+
+    def write(self) -> None:
+        if self.filename is None or not is_project(self.filename):
+            self.export_midi()
+            return
+
+        # The journal keeps the edits until the song is actually saved
+        try:
+            appended = save_project(self.song, self.filename, self.view_state)
+        except OSError as e:
+            self.message = f"Could not write {self.filename}: {e.strerror}"
+            return
+        if self.song.journal is not None:
+            self.song.journal.reset(self.filename)
+        if appended:
+            self.message = f"Saved changes to {self.filename}"
+        else:
+            self.message = f"Saved project to {self.filename}"
+
+    # Projects are exported to a MIDI file of the same name. The song's events
+    # are copied here and written from another thread, so that editing can
+    # continue while a long song is written.
     def export_midi(self) -> None:
         if self.filename is None:
             self.message = ERROR_MIDO
             return
+        if self.export_thread is not None:
+            self.message = f"Still writing MIDI to {self.export_filename}"
+            return
+
+        filename = self.filename
+        if is_project(filename):
+            filename = filename[: -len(PROJECT_EXTENSION)] + ".mid"
+        tracks = self.song.get_export_tracks()
+        if filename == self.filename and self.song.journal is not None:
+            self.song.journal.begin_save()
+        self.export_filename = filename
+        self.export_error = None
+        self.export_thread = Thread(
+            target=self.run_export,
+            args=(filename, self.song.ticks_per_beat, tracks),
+        )
+        self.export_thread.start()
+        self.message = f"Writing MIDI to {filename}..."
 
-        self.song.export_midi(self.filename)
-        self.message = f"Wrote MIDI to {self.filename}"
+    def run_export(
+        self, filename: str, ticks_per_beat: int, tracks: list[ExportTrack]
+    ) -> None:
+        try:
+            write_midi(filename, ticks_per_beat, tracks)
+        except OSError as e:
+            self.export_error = f"Could not write {filename}: {e.strerror}"
+        # Anything else would end the thread silently and be taken for a
+        # successful write
+        except Exception as e:
+            self.export_error = f"Could not write {filename}: {e}"
+
+    # Returns whether an export finished, which is checked from the main loop
+    # so that the journal is only ever reset from the song's own thread
+    def finish_export(self, wait: bool = False) -> bool:
+        if self.export_thread is None or (
+            not wait and self.export_thread.is_alive()
+        ):
+            return False
+
+        self.export_thread.join()
+        self.export_thread = None
+        filename = self.export_filename
+        journal = self.song.journal
+        if self.export_error is not None:
+            self.message = self.export_error
+            if filename == self.filename and journal is not None:
+                journal.cancel_save()
+        else:
+            self.message = f"Wrote MIDI to {filename}"
+            if filename == self.filename and journal is not None:
+                journal.reset(filename)
+        return True
 
     def cycle_notes(self) -> bool:
         if self.last_note is not None and len(self.last_chord) >= 2:
@@ -1110,10 +1909,11 @@ class Interface:
     def deselect(self) -> None:
         self.last_note = None
         self.last_chord = []
+        self.mark = None
 
     def escape(self) -> None:
         if not self.insert:
-            if self.last_note is None:
+            if self.last_note is None and self.mark is None:
                 self.message = "Press Ctrl+C to exit MusiCLI"
             else:
                 self.deselect()
@@ -1121,12 +1921,12 @@ class Interface:
             self.stop_notes()
             self.insert = False
 
-    def handle_action(self, action: Action) -> None:
+    def handle_action(self, action: Action, count: int = 1) -> None:
         # Pan view
-        x_pan = self.song.cols_per_beat * self.song.beats_per_measure
-        x_pan_short = self.song.cols_per_beat
-        y_pan = NOTES_PER_OCTAVE
-        y_pan_short = 1
+        x_pan = self.song.cols_per_beat * self.song.beats_per_measure * count
+        x_pan_short = self.song.cols_per_beat * count
+        y_pan = NOTES_PER_OCTAVE * count
+        y_pan_short = count
         if action == Action.PAN_LEFT:
             self.set_x_offset(self.x_offset - x_pan)
         elif action == Action.PAN_LEFT_SHORT:
@@ -1144,13 +1944,13 @@ class Interface:
         elif action == Action.PAN_DOWN_SHORT:
             self.set_y_offset(self.y_offset - y_pan_short)
         elif action == Action.EDIT_LEFT:
-            self.move_cursor(left=True)
+            self.move_cursor(left=True, count=count)
         elif action == Action.EDIT_RIGHT:
-            self.move_cursor(left=False)
+            self.move_cursor(left=False, count=count)
         elif action == Action.EDIT_UP:
-            self.set_octave(increase=True)
+            self.set_octave(increase=True, count=count)
         elif action == Action.EDIT_DOWN:
-            self.set_octave(increase=False)
+            self.set_octave(increase=False, count=count)
         elif action == Action.JUMP_LEFT:
             self.snap_to_time(0)
         elif action == Action.JUMP_RIGHT:
@@ -1235,15 +2035,64 @@ class Interface:
             self.restart_playback(self.time)
         elif action == Action.CURSOR_TO_PLAYHEAD:
             self.cursor_to_playhead()
+        elif action == Action.RECORD_TOGGLE:
+            self.toggle_recording()
+        elif action == Action.LOOP_TOGGLE:
+            self.toggle_loop()
+        elif action == Action.SELECT_RANGE:
+            self.select_range()
+        elif action == Action.SELECT_TRACK:
+            self.select_track()
+        elif action == Action.TRANSPOSE_DEC:
+            self.transpose(increase=False)
+        elif action == Action.TRANSPOSE_INC:
+            self.transpose(increase=True)
+        elif action == Action.QUANTIZE:
+            self.quantize()
+        elif action == Action.UNDO:
+            self.undo()
+        elif action == Action.REDO:
+            self.undo(redo=True)
+        elif action == Action.WRITE:
+            self.write()
         elif action == Action.WRITE_MIDI:
             self.export_midi()
+        elif action == Action.MERGE_MIDI:
+            self.start_merge()
+        elif action == Action.ANALYSIS_TOGGLE:
+            self.toggle_analysis()
         elif action == Action.QUIT_HELP:
             self.message = "Press Ctrl+C to exit MusiCLI"
 
+    # Keys edit the prompt's text until it is submitted with Enter or
+    # cancelled with Escape
+    def handle_prompt_input(self, input_code: int) -> None:
+        prompt = self.prompt
+        assert prompt is not None
+        if input_code == curses.ascii.ESC:
+            self.prompt = None
+            self.message = ""
+        elif input_code in (curses.ascii.LF, curses.ascii.CR, curses.KEY_ENTER):
+            self.prompt = None
+            self.message = ""
+            prompt.submit(prompt.text)
+        elif input_code in (
+            curses.KEY_BACKSPACE,
+            curses.ascii.BS,
+            curses.ascii.DEL,
+        ):
+            prompt.text = prompt.text[:-1]
+        elif curses.ascii.isprint(input_code):
+            prompt.text += chr(input_code)
+
     def handle_input(self, input_code: int) -> bool:
         if input_code == curses.ERR:
             return False
 
+        if self.prompt is not None:
+            self.handle_prompt_input(input_code)
+            return True
+
         if curses.ascii.isprint(input_code):
             input_char = chr(input_code)
         else:
@@ -1253,6 +2102,9 @@ class Interface:
         self.message = ""
         self.highlight_track = False
 
+        # Everything changed by a single keypress is undone together
+        self.song.history.commit()
+
         if self.insert:
             number = INSERT_KEYMAP.get(
                 SYMBOLS_TO_NUMBERS.get(input_char, input_char.lower())
@@ -1286,17 +2138,60 @@ class Interface:
             return False
 
         if action is not None:
-            for _ in range(max(self.repeat_count, 1)):
-                self.handle_action(action)
+            count = max(self.repeat_count, 1)
             self.repeat_count = 0
+            if action in SCALED_ACTIONS:
+                self.handle_action(action, count)
+            else:
+                for _ in range(count):
+                    self.handle_action(action)
             return True
 
         return False
 
+    # Handles keys that arrive before the deadline without redrawing, so that
+    # the screen never falls more than a frame behind however fast keys come
+    # in. A run of the same key that moves the view or the cursor is applied
+    # all at once, except for digits, which would add to the repeat count.
+    def handle_pending_input(self, deadline: float) -> None:
+        while True:
+            remaining = deadline - perf_counter()
+            if remaining <= 0:
+                return
+            self.window.timeout(ceil(remaining * 1000))
+            input_code = self.window.getch()
+            if input_code == curses.ERR:
+                return
+            input_codes = [input_code]
+            self.window.timeout(0)
+            while (input_code := self.window.getch()) != curses.ERR:
+                input_codes.append(input_code)
+            for input_code, run in groupby(input_codes):
+                count = len(list(run))
+                if (
+                    count > 1
+                    and not self.insert
+                    and self.prompt is None
+                    and self.repeat_count == 0
+                    and not ord("0") <= input_code <= ord("9")
+                    and KEYMAP.get(input_code) in SCALED_ACTIONS
+                ):
+                    self.repeat_count = count
+                    count = 1
+                for _ in range(count):
+                    self.handle_input(input_code)
+
     def main(self) -> None:
         # Loop until user the exits
         previous_playhead = 0
         redraw = True
+        input_time = None
+        draw_time = 0.0
+
+        # Poll for input while the soundfont loads, so that the status bar is
+        # updated as soon as it finishes
+        loading = self.player is not None and not self.player.loaded.is_set()
+
         while True:
             if (
                 self.player is not None
@@ -1307,9 +2202,29 @@ class Interface:
                 self.snap_to_time(self.player.playhead, center=False)
 
             if redraw:
+                self.handle_pending_input(draw_time + FRAME_SECONDS)
+                draw_time = perf_counter()
                 self.draw()
                 self.window.refresh()
-
+                if self.stats is not None:
+                    now = perf_counter()
+                    self.stats.draw.record(now - draw_time)
+                    if input_time is not None:
+                        self.stats.input.record(now - input_time)
+                        input_time = None
+
+            # Poll during playback so that the playhead keeps moving
+            if self.show_analysis:
+                self.analyzer.start(self.song)
+            if (
+                loading
+                or PLAY_EVENT.is_set()
+                or self.export_thread is not None
+                or (self.show_analysis and self.analyzer.busy)
+            ):
+                self.window.timeout(POLL_MILLISECONDS)
+            else:
+                self.window.timeout(-1)
             input_code = self.window.getch()
 
             if KILL_EVENT.is_set():
@@ -1324,7 +2239,23 @@ class Interface:
             if self.player is not None and PLAY_EVENT.is_set():
                 previous_playhead = self.player.playhead
 
-            if redraw:
-                self.window.erase()
+            if self.finish_export():
+                redraw = True
+            if self.analyzer.receive():
+                redraw = True
+            if self.merge_recording():
+                redraw = True
+
+            if loading:
+                assert self.player is not None
+                if self.player.loaded.is_set():
+                    loading = False
+                    redraw = True
+                    if self.player.error is not None:
+                        self.message = self.player.error
+
+            # Input latency is measured from here until the redraw is shown
+            if input_code != curses.ERR:
+                input_time = perf_counter()
 
             self.handle_input(input_code)
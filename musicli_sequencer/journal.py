@@ -0,0 +1,294 @@
+from __future__ import annotations
+import json
+import mmap
+import os
+import os.path
+from threading import Event, Lock, Thread
+from typing import Any, Optional, TYPE_CHECKING
+
+from .project import (
+    CORRUPT_ERRORS,
+    EDIT_RECORD,
+    EDITS,
+    HEADER,
+    MAGIC,
+    VERSION,
+    apply_sections,
+    pack_events,
+    pack_meta,
+    pack_section,
+    read_sections,
+)
+from .song import Song
+
+if TYPE_CHECKING:
+    from .player import Player
+
+JOURNAL_SUFFIX = ".journal"
+
+# How often recorded edits are written to the journal
+FLUSH_SECONDS = 1.0
+
+# The saved file that the journal's edits apply to, as JSON
+BASE = b"BASE"
+
+Edit = tuple[int, int, int, int, int, int]
+
+
+def get_journal_path(path: str) -> str:
+    return path + JOURNAL_SUFFIX
+
+
+# Identifies a saved file by its size and modification time, so that a journal
+# is never replayed onto a file that was changed after it was written
+def describe_file(path: Optional[str]) -> dict[str, Any]:
+    if path is None or not os.path.isfile(path):
+        return {"path": None}
+    stat = os.stat(path)
+    return {
+        "path": os.path.abspath(path),
+        "size": stat.st_size,
+        "mtime_ns": stat.st_mtime_ns,
+    }
+
+
+def read_base(view: memoryview) -> Optional[dict[str, Any]]:
+    for tag, data in read_sections(view):
+        with data:
+            if tag == BASE:
+                return json.loads(bytes(data))
+    return None
+
+
+# Replays the journal onto the song if it was written for the file the song was
+# loaded from, returning the number of edits replayed, or None if there was no
+# journal to replay
+def recover_journal(
+    song: Song,
+    path: str,
+    base_path: Optional[str],
+    player: Optional[Player] = None,
+) -> Optional[int]:
+    if not os.path.isfile(path) or os.path.getsize(path) == 0:
+        return None
+    with open(path, "rb") as file:
+        mapping = mmap.mmap(file.fileno(), 0, access=mmap.ACCESS_READ)
+    try:
+        with memoryview(mapping) as view:
+            try:
+                if read_base(view) != describe_file(base_path):
+                    return None
+            except ValueError:
+                return None
+            edit_count = apply_sections(song, view, player)
+    except CORRUPT_ERRORS as e:
+        raise ValueError(f"Journal file is corrupt: {e}")
+    finally:
+        mapping.close()
+    # Recovered edits are part of the song the editor starts with
+    song.history.clear()
+    return edit_count
+
+
+# Records every edit made to the song and appends them to a journal file from
+# a background thread, so that they can be recovered after a crash. Each flush
+# writes only the edits made since the last one, plus the song's settings and
+# tracks if they changed. Changes that are not individual edits, like deleting
+# a track, are written as a snapshot of the whole song instead. While the song
+# is being saved in the background, the edits made since the save began are
+# kept as well, so that they can be written again after the journal is reset.
+class Journal:
+    path: str
+    song: Song
+    edits: list[Edit]
+    snapshot_data: Optional[bytes]
+    base: dict[str, Any]
+    meta: Optional[bytes]
+    # The song's settings and tracks as of the last edit recorded, packed on
+    # the song's own thread
+    pending_meta: bytes
+    unsaved: bool
+    saving: bool
+    save_edits: list[Edit]
+    save_snapshot: bool
+    save_meta: Optional[bytes]
+    lock: Lock
+    file_lock: Lock
+    stop_event: Event
+    thread: Thread
+
+    def __init__(
+        self,
+        path: str,
+        song: Song,
+        base_path: Optional[str],
+        recovered: bool = False,
+    ):
+        self.path = path
+        self.song = song
+        self.edits = []
+        self.snapshot_data = None
+        self.meta = None
+        self.pending_meta = pack_meta(song, song.view_state)
+        self.saving = False
+        self.save_edits = []
+        self.save_snapshot = False
+        self.save_meta = None
+        self.lock = Lock()
+        self.file_lock = Lock()
+        self.stop_event = Event()
+        if recovered:
+            # Recovered edits stay in the journal until the song is saved
+            self.base = describe_file(base_path)
+            self.unsaved = True
+        else:
+            self.reset(base_path)
+        song.journal = self
+        self.thread = Thread(target=self.run, daemon=True)
+        self.thread.start()
+
+    def record(self, edit: Edit) -> None:
+        with self.lock:
+            self.edits.append(edit)
+            if self.saving:
+                self.save_edits.append(edit)
+
+    # Called from the song's own thread whenever its tracks change, before any
+    # edit that refers to them is recorded, since the song cannot be read
+    # while it is being edited
+    def capture_meta(self, song: Song) -> None:
+        meta = pack_meta(song, song.view_state)
+        with self.lock:
+            self.pending_meta = meta
+
+    # Replaces every edit recorded so far; called from the song's own thread
+    def snapshot(self, song: Song) -> None:
+        meta = pack_meta(song, song.view_state)
+        data = meta + pack_events(song)
+        with self.lock:
+            self.edits = []
+            self.snapshot_data = data
+            self.pending_meta = meta
+            if self.saving:
+                self.save_edits = []
+                self.save_snapshot = True
+
+    # Called from the song's own thread when the song is copied to be saved
+    # from another thread
+    def begin_save(self) -> None:
+        meta = pack_meta(self.song, self.song.view_state)
+        with self.lock:
+            self.saving = True
+            self.save_edits = []
+            self.save_snapshot = False
+            self.save_meta = meta
+
+    def cancel_save(self) -> None:
+        with self.lock:
+            self.saving = False
+            self.save_edits = []
+
+    # Starts a new journal for the file the song was just saved to, keeping
+    # any edits made since the save began
+    def reset(self, base_path: Optional[str]) -> None:
+        with self.file_lock:
+            with self.lock:
+                saving, self.saving = self.saving, False
+                snapshot = saving and self.save_snapshot
+                self.edits, self.save_edits = self.save_edits, []
+                self.snapshot_data = None
+            self.base = describe_file(base_path)
+            self.write_base()
+            if saving:
+                self.meta = self.save_meta
+            else:
+                self.meta = pack_meta(self.song, self.song.view_state)
+                with self.lock:
+                    self.pending_meta = self.meta
+            self.unsaved = False
+        if snapshot:
+            self.snapshot(self.song)
+
+    # Written to a temporary file first, so that the old journal is kept until
+    # the new one is complete
+    def write_base(self, data: bytes = b"") -> None:
+        base = pack_section(BASE, json.dumps(self.base).encode())
+        temp_path = self.path + ".tmp"
+        try:
+            with open(temp_path, "wb") as file:
+                file.write(HEADER.pack(MAGIC, VERSION) + base + data)
+                file.flush()
+                os.fsync(file.fileno())
+            os.replace(temp_path, self.path)
+        except BaseException:
+            try:
+                os.remove(temp_path)
+            except OSError:
+                pass
+            raise
+
+    # Anything taken from the journal for a write that fails is put back, so
+    # that it is written by the next flush instead
+    def flush(self) -> None:
+        with self.file_lock:
+            # The settings are taken along with the edits, so that they always
+            # have the tracks the edits refer to
+            with self.lock:
+                edits, self.edits = self.edits, []
+                snapshot, self.snapshot_data = self.snapshot_data, None
+                meta = self.pending_meta
+            try:
+                if snapshot is not None:
+                    self.write_base(snapshot)
+                    snapshot = None
+                    self.meta = None
+                    self.unsaved = True
+                self.append(meta, edits)
+            except OSError:
+                with self.lock:
+                    # A newer snapshot replaces everything that was taken
+                    if self.snapshot_data is None:
+                        self.snapshot_data = snapshot
+                        self.edits = edits + self.edits
+                raise
+
+    def append(self, meta: bytes, edits: list[Edit]) -> None:
+        if meta == self.meta and len(edits) == 0:
+            return
+        data = meta if meta != self.meta else b""
+        if len(edits) > 0:
+            records = b"".join(EDIT_RECORD.pack(*edit) for edit in edits)
+            data += pack_section(EDITS, records)
+        end = os.path.getsize(self.path)
+        try:
+            with open(self.path, "ab") as file:
+                file.write(data)
+                file.flush()
+                os.fsync(file.fileno())
+        except OSError:
+            # A partly written section would hide the sections after it
+            os.truncate(self.path, end)
+            raise
+        self.meta = meta
+        self.unsaved = True
+
+    def run(self) -> None:
+        while not self.stop_event.wait(FLUSH_SECONDS):
+            try:
+                self.flush()
+            except OSError:
+                # Failing to write the journal should never stop editing
+                pass
+
+    # Writes any remaining edits, and removes the journal if nothing has
+    # changed since the song was last saved
+    def close(self) -> None:
+        self.stop_event.set()
+        self.thread.join()
+        self.song.journal = None
+        try:
+            self.flush()
+            if not self.unsaved:
+                os.remove(self.path)
+        except OSError:
+            pass
@@ -11,11 +11,14 @@ import os
 import os.path
 import sys
 from threading import Thread
+from time import perf_counter
 from traceback import format_exc
-from typing import Optional
+from typing import Hashable, Iterator, Optional
 
 from .interface import Interface, ERROR_FLUIDSYNTH, ERROR_MIDO, KEYMAP
+from .feed import ScheduledEvent
 from .song import (
+    Note,
     Song,
     COMMON_NAMES,
     DEFAULT_BEATS_PER_MEASURE,
@@ -28,6 +31,14 @@ from .song import (
     SCALES,
 )
 from .player import Player, IMPORT_FLUIDSYNTH, PLAY_EVENT, KILL_EVENT
+from .render import load_player, render_song, render_song_stems
+from .journal import Journal, get_journal_path, recover_journal
+from .output import FluidSynthOutput, MidoOutput, NullOutput, Output
+from .project import ProjectStream, is_project, load_project
+from .recorder import Recorder, get_input_names
+from .server import ServerOutput, get_default_socket, serve
+from .soundfont import load_preset_names
+from .stats import Stats
 
 # Default files
 DEFAULT_FILE = "untitled.mid"
@@ -51,25 +62,27 @@ CURSES_KEY_NAMES: dict[int, str] = {
     curses.ascii.TAB: "Tab",
     curses.ascii.LF: "Enter",
     curses.ascii.ESC: "Escape",
+    curses.ascii.DC2: "Ctrl+R",
 }
 
 ARGS: argparse.Namespace
 PLAYER: Optional[Player] = None
+RECORDER: Optional[Recorder] = None
+STATS: Optional[Stats] = None
 
 
-def wrapper(stdscr: curses.window) -> None:
-    # Hide curses cursor
-    curses.curs_set(0)
+def get_song_file() -> Optional[str]:
+    if ARGS.import_file and os.path.exists(ARGS.import_file):
+        return ARGS.import_file
+    return None
 
-    # Allow using default terminal colors (-1 = default color)
-    curses.use_default_colors()
 
-    if ARGS.import_file and os.path.exists(ARGS.import_file):
-        midi_file = ARGS.import_file
-    else:
-        midi_file = None
+def create_song() -> Song:
+    midi_file = get_song_file()
+    if midi_file is not None and is_project(midi_file):
+        return load_project(midi_file, PLAYER, ARGS.compact)
 
-    song = Song(
+    return Song(
         midi_file=midi_file,
         player=PLAYER,
         ticks_per_beat=ARGS.ticks_per_beat,
@@ -77,19 +90,119 @@ def wrapper(stdscr: curses.window) -> None:
         beats_per_measure=ARGS.beats_per_measure,
         key=NAME_TO_NUMBER[ARGS.key],
         scale_name=ARGS.scale,
+        compact=ARGS.compact,
+        import_jobs=ARGS.import_jobs,
     )
 
+
+def render(path: str, soundfont: str) -> None:
+    song = create_song()
+    start = perf_counter()
+    try:
+        if ARGS.render_jobs > 1 or ARGS.stems is not None:
+            seconds = render_song_stems(
+                song, soundfont, path, ARGS.render_jobs, ARGS.stems
+            )
+        else:
+            player = load_player(soundfont)
+            try:
+                seconds = render_song(song, player, path)
+            finally:
+                player.delete()
+    except ValueError as e:
+        print(e)
+        sys.exit(1)
+    elapsed = perf_counter() - start
+    print(
+        f"Rendered {seconds:.1f} seconds of audio to {path} in "
+        f"{elapsed:.1f} seconds"
+    )
+
+
+# Notes are identified by when they start rather than by their events, which
+# are not kept in compact mode
+def get_song_events(song: Song) -> Iterator[tuple[Hashable, ScheduledEvent]]:
+    for event in song.events:
+        note_id: Hashable = None
+        if isinstance(event, Note):
+            start = event if event.on or event.pair is None else event.pair
+            note_id = start.time, event.channel, event.number
+        yield note_id, event.to_scheduled()
+
+
+# Projects are streamed from their files, so that songs of any length are
+# played in the same amount of memory
+def play(player: Player) -> None:
+    player.load()
+    if player.error is not None:
+        print(player.error)
+        sys.exit(1)
+    path = get_song_file()
+    try:
+        if path is not None and is_project(path):
+            with ProjectStream(path) as stream:
+                for track in stream.tracks:
+                    track.register(player)
+                player.play_events(stream, stream.tempo_map)
+        else:
+            song = create_song()
+            for track in song.tracks:
+                track.register(player)
+            player.play_events(get_song_events(song), song.tempo_map)
+    except KeyboardInterrupt:
+        pass
+    except ValueError as e:
+        print(e)
+        sys.exit(1)
+    finally:
+        player.delete()
+
+
+def wrapper(stdscr: curses.window) -> None:
+    # Hide curses cursor
+    curses.curs_set(0)
+
+    # Allow using default terminal colors (-1 = default color)
+    curses.use_default_colors()
+
+    song = create_song()
+
+    # Edits made since the song was last saved are recovered from the journal
+    journal = None
+    recovered = None
+    if ARGS.journal and ARGS.file is not None:
+        journal_path = get_journal_path(ARGS.file)
+        song_file = get_song_file()
+        recovered = recover_journal(song, journal_path, song_file, PLAYER)
+        journal = Journal(
+            journal_path, song, song_file, recovered is not None
+        )
+
     if PLAYER is not None:
         playback_thread = Thread(
-            target=PLAYER.try_play_song, args=[song, CRASH_FILE]
+            target=PLAYER.try_play_song, args=[song.create_feed(), CRASH_FILE]
         )
         playback_thread.start()
     else:
         playback_thread = None
 
     status = 0
+    interface = None
     try:
-        interface = Interface(stdscr, song, PLAYER, ARGS.file, ARGS.unicode)
+        interface = Interface(
+            stdscr,
+            song,
+            PLAYER,
+            ARGS.file,
+            ARGS.unicode,
+            STATS,
+            RECORDER,
+            ARGS.analysis_jobs,
+        )
+        if recovered is not None:
+            interface.message = (
+                f"Recovered {recovered} unsaved edits from {journal_path}"
+            )
         interface.main()
     except Exception:
         status = 1
@@ -97,12 +210,24 @@ def wrapper(stdscr: curses.window) -> None:
             crash_file.write(format_exc())
     finally:
         curses.cbreak()
+        # A MIDI file still being written is finished before the journal is
+        # closed, so that the journal knows whether the song was saved
+        if interface is not None:
+            interface.finish_export(wait=True)
+            interface.analyzer.close()
+        if journal is not None:
+            journal.close()
+        if RECORDER is not None:
+            RECORDER.close()
         PLAY_EVENT.set()
         KILL_EVENT.set()
         if playback_thread is not None:
             playback_thread.join()
         if PLAYER is not None:
-            PLAYER.synth.delete()
+            PLAYER.delete()
+        if STATS is not None and ARGS.stats_file is not None:
+            with open(ARGS.stats_file, "w") as stats_file:
+                STATS.write(stats_file)
         sys.exit(status)
 
 
@@ -159,7 +284,10 @@ def main() -> None:
         "file",
         type=optional_file,
         nargs="?",
-        help=f"MIDI file to read from and write to (default: {DEFAULT_FILE})",
+        help=(
+            "MIDI file or .mcli project file to read from and write to "
+            f"(default: {DEFAULT_FILE})"
+        ),
     )
     parser.add_argument(
         "-i",
@@ -180,6 +308,99 @@ def main() -> None:
             f"{DEFAULT_SOUNDFONT})"
         ),
     )
+    parser.add_argument(
+        "--lookahead",
+        type=positive_int,
+        metavar="MS",
+        help=(
+            "send notes to the synthesizer this many milliseconds ahead of "
+            "time, so that they are played at exactly the right time "
+            "(default: disabled)"
+        ),
+    )
+    parser.add_argument(
+        "--midi-input",
+        nargs="?",
+        const="",
+        metavar="PORT",
+        help=(
+            "open a MIDI input port to play and record notes from (default: "
+            "the system's default port); requires mido and python-rtmidi"
+        ),
+    )
+    parser.add_argument(
+        "--midi-output",
+        nargs="?",
+        const="",
+        metavar="PORT",
+        help=(
+            "play through a MIDI output port instead of a soundfont (default: "
+            "the system's default port); requires mido and python-rtmidi"
+        ),
+    )
+    parser.add_argument(
+        "--server",
+        nargs="?",
+        const="",
+        metavar="SOCKET",
+        help=(
+            "play through a server started with --serve instead of loading "
+            f"a soundfont (default: {get_default_socket()})"
+        ),
+    )
+    parser.add_argument(
+        "--serve",
+        nargs="?",
+        const="",
+        metavar="SOCKET",
+        help=(
+            "load the soundfont once and play for editors started with "
+            "--server until interrupted, without opening the editor "
+            f"(default: {get_default_socket()})"
+        ),
+    )
+    parser.add_argument(
+        "--null-output",
+        action="store_true",
+        help="play without sending notes anywhere, for measuring playback",
+    )
+    parser.add_argument(
+        "--play",
+        action="store_true",
+        help=(
+            "play the song once and exit, without opening the editor; "
+            ".mcli project files are streamed, so songs of any length can "
+            "be played"
+        ),
+    )
+    parser.add_argument(
+        "--render",
+        metavar="AUDIO_FILE",
+        help=(
+            "render the song to a .wav, .flac or .ogg file as fast as "
+            "possible and exit, without opening the editor; requires a "
+            "soundfont"
+        ),
+    )
+    parser.add_argument(
+        "--render-jobs",
+        type=positive_int,
+        default=1,
+        help=(
+            "with --render, render each track on its own synthesizer, using "
+            "up to this many processes at once; effects, polyphony and "
+            "controllers are then per track, so the mix can differ from a "
+            "serial render (default: 1)"
+        ),
+    )
+    parser.add_argument(
+        "--stems",
+        metavar="DIR",
+        help=(
+            "with --render, also write each track to its own .wav file in this "
+            "directory"
+        ),
+    )
     parser.add_argument(
         "--ticks-per-beat",
         type=positive_int,
@@ -235,6 +456,58 @@ def main() -> None:
         ),
     )
     parser.set_defaults(unicode=True)
+    parser.add_argument(
+        "--compact",
+        action="store_true",
+        help=(
+            "store events in packed columns, using less memory for very large "
+            "songs at the cost of slightly slower editing"
+        ),
+    )
+    parser.add_argument(
+        "--import-jobs",
+        type=positive_int,
+        default=1,
+        help=(
+            "the number of processes to use to read the tracks of a MIDI file "
+            "in parallel (default: 1)"
+        ),
+    )
+    parser.add_argument(
+        "--analysis-jobs",
+        type=positive_int,
+        default=1,
+        help=(
+            "the number of processes to use to analyze tracks in parallel "
+            "while the analysis lane is shown (default: 1)"
+        ),
+    )
+    parser.add_argument(
+        "--journal",
+        action=BooleanOptionalAction,
+        default=True,
+        help=(
+            "enable/disable keeping a journal of unsaved edits next to the "
+            "file, which is replayed if MusiCLI exits without saving "
+            "(default: enabled)"
+        ),
+    )
+    parser.add_argument(
+        "--stats",
+        action="store_true",
+        help=(
+            "measure drawing, input, playback and synthesizer times, and show "
+            "them on the status bar"
+        ),
+    )
+    parser.add_argument(
+        "--stats-file",
+        type=str,
+        help=(
+            "file to write histograms of the measured times to on exit; "
+            "implies --stats"
+        ),
+    )
     parser.add_argument(
         "--crash-file",
         type=FileType("w"),
@@ -281,9 +554,81 @@ def main() -> None:
         print("pip3 install pyfluidsynth")
         sys.exit(1)
 
-    if ARGS.soundfont is not None and IMPORT_FLUIDSYNTH:
+    if ARGS.stats or ARGS.stats_file is not None:
+        global STATS
+        STATS = Stats()
+
+    # Instrument names are shown from the soundfont's presets where possible
+    if ARGS.soundfont is not None:
+        try:
+            load_preset_names(ARGS.soundfont)
+        except (OSError, ValueError):
+            pass
+
+    if ARGS.render is not None:
+        if ARGS.soundfont is None:
+            print("A soundfont is required to render a song")
+            sys.exit(1)
+        render(ARGS.render, ARGS.soundfont)
+        sys.exit(0)
+
+    if ARGS.serve is not None:
+        if ARGS.soundfont is None:
+            print("A soundfont is required to run a server")
+            sys.exit(1)
+        try:
+            serve(ARGS.serve or get_default_socket(), ARGS.soundfont)
+        except ValueError as e:
+            print(e)
+            sys.exit(1)
+        sys.exit(0)
+
+    output: Optional[Output] = None
+    if ARGS.null_output:
+        output = NullOutput()
+    elif ARGS.midi_output is not None:
+        if not IMPORT_MIDO:
+            print(ERROR_MIDO)
+            sys.exit(1)
+        output = MidoOutput(ARGS.midi_output or None)
+    elif ARGS.server is not None:
+        output = ServerOutput(ARGS.server or get_default_socket())
+    elif ARGS.soundfont is not None and IMPORT_FLUIDSYNTH:
+        output = FluidSynthOutput(ARGS.soundfont)
+
+    if output is not None:
         global PLAYER
-        PLAYER = Player(ARGS.soundfont)
+        if ARGS.lookahead is not None:
+            PLAYER = Player(output, lookahead=ARGS.lookahead / 1000)
+        else:
+            PLAYER = Player(output)
+        PLAYER.stats = STATS
+
+    if ARGS.play:
+        if PLAYER is None:
+            print("A soundfont or other output is required to play a song")
+            sys.exit(1)
+        play(PLAYER)
+        sys.exit(0)
+
+    if ARGS.midi_input is not None:
+        if not IMPORT_MIDO:
+            print(ERROR_MIDO)
+            sys.exit(1)
+        global RECORDER
+        try:
+            RECORDER = Recorder(ARGS.midi_input or None, PLAYER)
+        except (ImportError, OSError) as e:
+            print(f"Could not open MIDI input port: {e}")
+            try:
+                names = get_input_names()
+            except (ImportError, OSError):
+                names = []
+            if len(names) > 0:
+                print("Available ports:")
+                for name in names:
+                    print(f"\t{name}")
+            sys.exit(1)
 
     if ARGS.crash_file is not None:
         CRASH_FILE = ARGS.crash_file
@@ -0,0 +1,100 @@
+import os
+from typing import Iterable, Optional
+
+from .feed import ScheduledEvent
+
+NOTE_ON = 0x90
+PROGRAM_CHANGE = 0xC0
+SYSEX = 0xF0
+END_OF_TRACK = b"\xff\x2f\x00"
+
+# The channel and program of a track, and its events in order. Events that
+# belong to no track, like tempo changes, are written to a track without a
+# channel.
+ExportTrack = tuple[Optional[int], Optional[int], list[ScheduledEvent]]
+
+
+def encode_variable_int(value: int) -> bytes:
+    data = [value & 0x7F]
+    value >>= 7
+    while value > 0:
+        data.append(0x80 | (value & 0x7F))
+        value >>= 7
+    return bytes(reversed(data))
+
+
+# Encodes a track chunk in a single pass over its events, leaving out status
+# bytes that repeat the previous one. Note offs are written as note ons with
+# no velocity, which means the same, so that one status byte can cover a whole
+# run of notes on a channel.
+def encode_track(
+    channel: Optional[int],
+    program: Optional[int],
+    events: Iterable[ScheduledEvent],
+) -> bytes:
+    data = bytearray()
+    status = None
+    if channel is not None and program is not None:
+        status = PROGRAM_CHANGE | channel
+        data += bytes((0, status, program))
+    time = 0
+    for event in events:
+        data += encode_variable_int(event.time - time)
+        time = event.time
+        if event.is_note:
+            assert event.channel is not None
+            new_status = NOTE_ON | event.channel
+            body: Iterable[int] = (
+                event.number,
+                event.velocity if event.on else 0,
+            )
+        else:
+            message = event.message
+            raw = message.bytes()
+            # Meta and system exclusive messages cancel running status
+            if message.is_meta:
+                data += bytes(raw)
+                status = None
+                continue
+            if raw[0] == SYSEX:
+                data.append(SYSEX)
+                data += encode_variable_int(len(raw) - 1)
+                data += bytes(raw[1:])
+                status = None
+                continue
+            new_status = raw[0]
+            if event.channel is not None and new_status < SYSEX:
+                new_status = (new_status & 0xF0) | event.channel
+            body = raw[1:]
+        if new_status != status:
+            data.append(new_status)
+            status = new_status
+        data += bytes(body)
+    data += encode_variable_int(0) + END_OF_TRACK
+    return b"MTrk" + len(data).to_bytes(4, "big") + bytes(data)
+
+
+# Written to a temporary file first, so that a failed write does not leave the
+# file half written, and the temporary file is removed if the write fails
+def write_midi(
+    path: str, ticks_per_beat: int, tracks: list[ExportTrack]
+) -> None:
+    temp_path = path + ".tmp"
+    try:
+        with open(temp_path, "wb") as file:
+            file.write(
+                b"MThd"
+                + (6).to_bytes(4, "big")
+                + (1).to_bytes(2, "big")
+                + len(tracks).to_bytes(2, "big")
+                + ticks_per_beat.to_bytes(2, "big")
+            )
+            for channel, program, events in tracks:
+                file.write(encode_track(channel, program, events))
+        os.replace(temp_path, path)
+    except BaseException:
+        try:
+            os.remove(temp_path)
+        except OSError:
+            pass
+        raise
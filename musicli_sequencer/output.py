@@ -0,0 +1,198 @@
+from __future__ import annotations
+from abc import ABC, abstractmethod
+from typing import Any, Iterable, Optional, TYPE_CHECKING
+
+from .feed import ScheduledEvent
+from .song import DRUM_BANK, MIDI_CHANNELS
+
+if TYPE_CHECKING:
+    from fluidsynth import Synth
+
+# Synthesizer samples per second
+SAMPLE_RATE = 44100
+
+# Sent on every channel when a MIDI output is closed, so that no notes are
+# left hanging on the device
+ALL_NOTES_OFF = 123
+
+
+# Where the player sends notes and other messages. Outputs are loaded on the
+# playback thread, since some take several seconds to load.
+class Output(ABC):
+    # Raises ValueError with a message to show if the output cannot be used
+    def load(self) -> None:
+        pass
+
+    def delete(self) -> None:
+        pass
+
+    @abstractmethod
+    def note_on(self, channel: int, number: int, velocity: int) -> None:
+        pass
+
+    @abstractmethod
+    def note_off(self, channel: int, number: int) -> None:
+        pass
+
+    @abstractmethod
+    def program_select(self, channel: int, bank: int, program: int) -> None:
+        pass
+
+    @abstractmethod
+    def pitch_bend(self, channel: int, pitch: int) -> None:
+        pass
+
+    @abstractmethod
+    def cc(self, channel: int, control: int, value: int) -> None:
+        pass
+
+    # Sends every event due at the same tick at once
+    def send(self, events: Iterable[ScheduledEvent]) -> None:
+        for event in events:
+            self.send_event(event)
+
+    def send_event(self, event: ScheduledEvent) -> None:
+        assert event.channel is not None
+        if event.is_note:
+            if event.on:
+                self.note_on(event.channel, event.number, event.velocity)
+            else:
+                self.note_off(event.channel, event.number)
+        elif event.message.type == "pitchwheel":
+            self.pitch_bend(event.channel, event.message.pitch)
+        elif event.message.type == "control_change":
+            self.cc(event.channel, event.message.control, event.message.value)
+
+
+class FluidSynthOutput(Output):
+    soundfont_path: str
+    audio: bool
+    channels: int
+    synth: Synth
+    soundfont: int
+
+    # Without audio, samples must be read from the synth instead
+    def __init__(
+        self, soundfont: str, audio: bool = True, channels: int = MIDI_CHANNELS
+    ):
+        self.soundfont_path = soundfont
+        self.audio = audio
+        self.channels = channels
+
+    def load(self) -> None:
+        try:
+            from fluidsynth import Synth
+        except ImportError as e:
+            raise ValueError(f"FluidSynth could not be imported: {e}")
+
+        synth = Synth(samplerate=SAMPLE_RATE, channels=self.channels)
+        soundfont = synth.sfload(self.soundfont_path)
+        if soundfont < 0:
+            synth.delete()
+            raise ValueError(
+                f"Could not load soundfont {self.soundfont_path}"
+            )
+        if self.audio:
+            synth.start()
+        self.synth = synth
+        self.soundfont = soundfont
+
+    def delete(self) -> None:
+        self.synth.delete()
+
+    def note_on(self, channel: int, number: int, velocity: int) -> None:
+        self.synth.noteon(channel, number, velocity)
+
+    def note_off(self, channel: int, number: int) -> None:
+        self.synth.noteoff(channel, number)
+
+    def program_select(self, channel: int, bank: int, program: int) -> None:
+        self.synth.program_select(channel, self.soundfont, bank, program)
+
+    def pitch_bend(self, channel: int, pitch: int) -> None:
+        self.synth.pitch_bend(channel, pitch)
+
+    def cc(self, channel: int, control: int, value: int) -> None:
+        self.synth.cc(channel, control, value)
+
+
+# Sends messages to a MIDI output port, such as a hardware synthesizer, a DAW
+# or a synthesizer shared by several editors
+class MidoOutput(Output):
+    port_name: Optional[str]
+    port: Any
+
+    def __init__(self, port_name: Optional[str] = None):
+        self.port_name = port_name
+
+    @property
+    def name(self) -> str:
+        return self.port_name or "the default MIDI output port"
+
+    def load(self) -> None:
+        try:
+            from mido import open_output
+
+            self.port = open_output(self.port_name)
+        except (ImportError, OSError) as e:
+            raise ValueError(f"Could not open {self.name}: {e}")
+
+    def delete(self) -> None:
+        for channel in range(MIDI_CHANNELS):
+            self.cc(channel, ALL_NOTES_OFF, 0)
+        self.port.close()
+
+    def send_message(self, message_type: str, **kwargs) -> None:
+        from mido import Message
+
+        self.port.send(Message(message_type, **kwargs))
+
+    def note_on(self, channel: int, number: int, velocity: int) -> None:
+        self.send_message(
+            "note_on", channel=channel, note=number, velocity=velocity
+        )
+
+    def note_off(self, channel: int, number: int) -> None:
+        self.send_message("note_off", channel=channel, note=number)
+
+    # General MIDI devices play drums on the drum channel whatever its
+    # program, unlike FluidSynth, which selects drum kits by bank
+    def program_select(self, channel: int, bank: int, program: int) -> None:
+        if bank != DRUM_BANK:
+            self.send_message(
+                "program_change", channel=channel, program=program
+            )
+
+    def pitch_bend(self, channel: int, pitch: int) -> None:
+        self.send_message("pitchwheel", channel=channel, pitch=pitch)
+
+    def cc(self, channel: int, control: int, value: int) -> None:
+        self.send_message(
+            "control_change", channel=channel, control=control, value=value
+        )
+
+    # Messages other than notes are passed on as they are, since a device may
+    # understand more of them than the synthesizer does
+    def send_event(self, event: ScheduledEvent) -> None:
+        if event.is_note:
+            super().send_event(event)
+        else:
+            self.port.send(event.message.copy(channel=event.channel))
+
+
+# Discards everything, for measuring playback without a synthesizer
+class NullOutput(Output):
+    def note_on(self, channel: int, number: int, velocity: int) -> None:
+        pass
+
+    def note_off(self, channel: int, number: int) -> None:
+        pass
+
+    def program_select(self, channel: int, bank: int, program: int) -> None:
+        pass
+
+    def pitch_bend(self, channel: int, pitch: int) -> None:
+        pass
+
+    def cc(self, channel: int, control: int, value: int) -> None:
+        pass
@@ -1,59 +1,325 @@
+from __future__ import annotations
+from ctypes import c_int, c_short, c_void_p
+from importlib.util import find_spec
 import sys
-from threading import Event
-from time import sleep
+from threading import Event, Lock
+from time import perf_counter, sleep
 from traceback import format_exc
+from itertools import groupby
+from typing import Any, Hashable, Iterable, Optional, Union, TYPE_CHECKING
 
-from mido import tempo2bpm
+from .eventlist import EventList
+from .feed import Feed, ScheduledEvent, Schedule
+from .output import FluidSynthOutput, Output
+from .song import Note, TempoMap, time_key
+from .stats import Stats
 
-from .song import MessageEvent, Note, Song, DEFAULT_BPM
+if TYPE_CHECKING:
+    from fluidsynth import Sequencer
 
-try:
-    from fluidsynth import Synth
-
-    IMPORT_FLUIDSYNTH = True
-except ImportError:
-    IMPORT_FLUIDSYNTH = False
+# fluidsynth is only imported once the player is loaded
+IMPORT_FLUIDSYNTH = find_spec("fluidsynth") is not None
 
 # Global thread events
 PLAY_EVENT = Event()
 RESTART_EVENT = Event()
 KILL_EVENT = Event()
 
+# Sleep until this many seconds before an event is due, then busy-wait
+SPIN_TIME = 0.002
+
+# Sequencer ticks per second
+SEQUENCER_TIME_SCALE = 1000
+
+
+class Clock:
+    tempo_map: TempoMap
+    start_time: float
+    start_tick: int
+    start_seconds: float
+
+    def __init__(self, tempo_map: TempoMap):
+        self.tempo_map = tempo_map
+        self.start(0)
+
+    def start(self, tick: int) -> None:
+        self.start_time = perf_counter()
+        self.start_tick = tick
+        self.start_seconds = self.tempo_map.ticks_to_seconds(tick)
+
+    def set_tempo_map(self, tempo_map: TempoMap, tick: int) -> None:
+        # Anchor to when the given tick was due under the old tempo map rather
+        # than the current time, so that the change does not introduce drift
+        self.start_time = self.deadline(tick)
+        self.start_tick = tick
+        self.tempo_map = tempo_map
+        self.start_seconds = tempo_map.ticks_to_seconds(tick)
+
+    def deadline(self, tick: int) -> float:
+        seconds = self.tempo_map.ticks_to_seconds(tick)
+        return self.start_time + seconds - self.start_seconds
+
+    # Continues from another tick exactly when the given one is due, so that
+    # looping back does not introduce drift
+    def jump(self, tick: int, to_tick: int) -> None:
+        self.start_time = self.deadline(tick)
+        self.start_tick = to_tick
+        self.start_seconds = self.tempo_map.ticks_to_seconds(to_tick)
+
+    def tick_at(self, time: float) -> int:
+        seconds = self.start_seconds + time - self.start_time
+        return self.tempo_map.seconds_to_ticks(seconds)
+
+    def wait(self, tick: int) -> float:
+        return self.wait_until(self.deadline(tick))
+
+    def wait_until(self, deadline: float) -> float:
+        remaining = deadline - perf_counter()
+        if remaining > SPIN_TIME:
+            sleep(remaining - SPIN_TIME)
+        now = perf_counter()
+        while now < deadline:
+            now = perf_counter()
+        return now - deadline
+
+
+# pyFluidSynth does not wrap removing events from its sequencer, so the
+# function is looked up in the library it loaded, if it has one
+def get_remove_events() -> Any:
+    import fluidsynth
+
+    library = getattr(fluidsynth, "_fl", None)
+    function = getattr(library, "fluid_sequencer_remove_events", None)
+    if function is not None:
+        function.argtypes = (c_void_p, c_short, c_short, c_int)
+        function.restype = None
+    return function
+
+
+# Marks the end of a loop in the list of events played while looping
+LOOP_END = object()
+
+
+# The events from the start of the loop up to its end, followed by an event
+# marking its end, or all of the events if there is no loop
+def get_loop_events(
+    events: EventList, loop: Optional[tuple[int, int]]
+) -> EventList:
+    if loop is None:
+        return events
+    start, end = loop
+    loop_events = list(
+        events.islice(
+            events.bisect_key_left(time_key(start)),
+            events.bisect_key_left(time_key(end)),
+        )
+    )
+    loop_events.append(
+        ScheduledEvent(time_key(end), end, None, -1, 0, False, LOOP_END)
+    )
+    return EventList(loop_events)
+
 
 class Player:
-    synth: Synth
-    soundfont: int
+    output: Output
     playhead: int
     restart_time: int
+    clock: Optional[Clock]
+    loop: Optional[tuple[int, int]]
+    stats: Optional[Stats]
+    lookahead: float
+    sequencer: Optional[Sequencer]
+    sequencer_id: int
+    sequencer_origin: tuple[float, int]
+    loaded: Event
+    error: Optional[str]
+    programs: dict[int, tuple[int, int]]
+    programs_lock: Lock
 
-    def __init__(self, soundfont: str):
-        self.synth = Synth()
-        self.synth.start()
-        self.soundfont = self.synth.sfload(soundfont)
+    # With a lookahead (in seconds), notes are sent that far ahead of time to
+    # FluidSynth's sequencer, which plays them at their exact times. The
+    # sequencer can only play through FluidSynth, so other outputs are always
+    # sent notes when they are due.
+    def __init__(self, output: Output, lookahead: float = 0.0):
+        self.output = output
 
         self.playhead = 0
         self.restart_time = 0
+        self.clock = None
+        self.loop = None
+        self.stats = None
+
+        self.lookahead = lookahead
+        self.sequencer = None
+
+        self.loaded = Event()
+        self.error = None
+        self.programs = {}
+        self.programs_lock = Lock()
 
     @property
     def playing(self) -> bool:
         return PLAY_EVENT.is_set()
 
-    def stop_note(self, note: Note) -> None:
-        self.synth.noteoff(note.channel, note.number)
+    @property
+    def ready(self) -> bool:
+        return self.loaded.is_set() and self.error is None
+
+    def fail(self, error: str) -> None:
+        self.error = error
+        self.loaded.set()
+
+    # Loading a large soundfont can take several seconds, so this is called
+    # from the playback thread rather than when the player is created
+    def load(self) -> None:
+        try:
+            self.output.load()
+        except ValueError as e:
+            self.fail(str(e))
+            return
+
+        if self.lookahead > 0 and isinstance(self.output, FluidSynthOutput):
+            from fluidsynth import Sequencer
+
+            self.sequencer = Sequencer(time_scale=SEQUENCER_TIME_SCALE)
+            self.sequencer_id = self.sequencer.register_fluidsynth(
+                self.output.synth
+            )
+            self.sync_sequencer()
+
+        # Instruments may have been chosen while the output was loading
+        with self.programs_lock:
+            for channel, (bank, instrument) in self.programs.items():
+                self.output.program_select(channel, bank, instrument)
+            self.loaded.set()
+
+    def delete(self) -> None:
+        if not self.ready:
+            return
+        if self.sequencer is not None:
+            self.sequencer.delete()
+        self.output.delete()
 
-    def play_note(self, note: Note) -> None:
+    def record_synth(self, start: float) -> None:
+        if self.stats is not None:
+            self.stats.synth.record(perf_counter() - start)
+
+    def stop_note(self, note: Union[Note, ScheduledEvent]) -> None:
+        start = perf_counter()
+        self.output.note_off(note.channel, note.number)
+        self.record_synth(start)
+
+    def play_note(self, note: Union[Note, ScheduledEvent]) -> None:
         if note.on:
-            self.synth.noteon(note.channel, note.number, note.velocity)
+            start = perf_counter()
+            self.output.note_on(note.channel, note.number, note.velocity)
+            self.record_synth(start)
         else:
             self.stop_note(note)
 
+    def send_message(self, event: ScheduledEvent) -> None:
+        start = perf_counter()
+        self.output.send_event(event)
+        self.record_synth(start)
+
+    def send(self, events: list[ScheduledEvent]) -> None:
+        start = perf_counter()
+        self.output.send(events)
+        self.record_synth(start)
+
+    # Records which sequencer tick corresponds to the current time
+    def sync_sequencer(self) -> None:
+        assert self.sequencer is not None
+        self.sequencer_origin = perf_counter(), self.sequencer.get_tick()
+
+    def schedule_note(self, note: ScheduledEvent, deadline: float) -> None:
+        assert self.sequencer is not None
+        origin_time, origin_tick = self.sequencer_origin
+        tick = origin_tick + round(
+            (deadline - origin_time) * SEQUENCER_TIME_SCALE
+        )
+        start = perf_counter()
+        if note.on:
+            self.sequencer.note_on(
+                tick,
+                note.channel,
+                note.number,
+                note.velocity,
+                dest=self.sequencer_id,
+            )
+        else:
+            self.sequencer.note_off(
+                tick, note.channel, note.number, dest=self.sequencer_id
+            )
+        self.record_synth(start)
+
+    # Waits for notes that were already sent to the sequencer to be played,
+    # unless the player is killed first
+    def drain_sequencer(self) -> None:
+        if self.sequencer is not None:
+            KILL_EVENT.wait(self.lookahead)
+
+    # Drops the notes sent to the sequencer that have not been played yet,
+    # including the note offs of notes already playing, which must be stopped
+    # afterwards
+    def cancel_sequencer(self) -> None:
+        if self.sequencer is None:
+            return
+        remove_events = get_remove_events()
+        if remove_events is None:
+            self.drain_sequencer()
+            return
+        # Any source and any type of event
+        remove_events(self.sequencer.sequencer, -1, self.sequencer_id, -1)
+
+    # The tick being played at the given time, which notes played on a MIDI
+    # input port are recorded at
+    def get_tick(self, time: float) -> int:
+        clock = self.clock
+        if clock is None or not self.playing:
+            return self.playhead
+        return max(clock.tick_at(time), 0)
+
+    def start_clock(self, clock: Clock, tick: int) -> None:
+        clock.start(tick)
+        if self.sequencer is not None:
+            self.sync_sequencer()
+
     def set_instrument(self, channel: int, bank: int, instrument: int) -> None:
-        self.synth.program_select(channel, self.soundfont, bank, instrument)
+        with self.programs_lock:
+            self.programs[channel] = bank, instrument
+            if self.ready:
+                start = perf_counter()
+                self.output.program_select(channel, bank, instrument)
+                self.record_synth(start)
 
-    def play_song(self, song: Song) -> None:
-        while True:
-            bpm = DEFAULT_BPM
+    # Sends note offs for every note still playing, at the given deadline if
+    # notes are being sent ahead of time
+    def end_notes(
+        self,
+        active_notes: dict[Any, ScheduledEvent],
+        deadline: float,
+    ) -> None:
+        offs = [note._replace(on=False) for note in active_notes.values()]
+        active_notes.clear()
+        if self.sequencer is not None:
+            for note in offs:
+                self.schedule_note(note, deadline)
+        elif len(offs) > 0:
+            self.send(offs)
 
+    # Plays from the player's own copy of the song, which is brought up to date
+    # with the edits published to the feed between events. While looping, only
+    # the loop's events are played, from a list that is built once and only
+    # rebuilt when the loop changes or an edit falls inside it.
+    def play_song(self, feed: Feed) -> None:
+        self.load()
+        if self.error is not None:
+            KILL_EVENT.wait()
+            sys.exit(0)
+
+        schedule = Schedule(feed.snapshot)
+        while True:
             if RESTART_EVENT.is_set():
                 RESTART_EVENT.clear()
 
@@ -61,78 +327,180 @@ class Player:
             if KILL_EVENT.is_set():
                 sys.exit(0)
 
-            if len(song) == 0:
+            schedule.update(feed)
+            loop = self.loop
+            self.playhead = self.restart_time
+            if loop is not None and not loop[0] <= self.playhead < loop[1]:
+                self.playhead = loop[0]
+            events = get_loop_events(schedule.events, loop)
+            event_index = events.bisect_key_left(time_key(self.playhead))
+            if event_index >= len(events):
                 PLAY_EVENT.clear()
                 continue
 
-            song.dirty = False
-            self.playhead = self.restart_time
-            next_unit_time = (
-                self.playhead
-                - (self.playhead % song.cols_to_ticks(1))
-                + song.cols_to_ticks(1)
-            )
-            event_index = song.get_next_index(self.playhead, inclusive=True)
-            next_event = song[event_index]
-            active_notes = []
-            while event_index < len(song):
-                delta = min(next_unit_time, next_event.time) - self.playhead
-                sleep(delta / song.ticks_per_beat / bpm * 60.0)
-
-                self.playhead += delta
+            unit = schedule.ticks_per_unit
+            next_unit_time = self.playhead - (self.playhead % unit) + unit
+            next_event = events[event_index]
+            active_notes = {}
+            clock = Clock(schedule.tempo_map)
+            self.start_clock(clock, self.playhead)
+            self.clock = clock
 
-                if self.playhead == next_unit_time:
-                    next_unit_time += song.cols_to_ticks(1)
+            # Events before this time have already been sent
+            sent_time = self.playhead
+            while event_index < len(events):
+                # Events are sent ahead of time if there is a lookahead, but the
+                # playhead only moves when its time is reached
+                send_deadline = clock.deadline(next_event.time) - self.lookahead
+                if send_deadline < clock.deadline(next_unit_time):
+                    clock.wait_until(send_deadline)
+                    send_time = next_event.time
+                    if self.sequencer is None:
+                        self.playhead = send_time
+                else:
+                    clock.wait(next_unit_time)
+                    self.playhead = next_unit_time
+                    next_unit_time += unit
+                    send_time = self.playhead
 
                 if not PLAY_EVENT.is_set():
-                    for note in active_notes:
+                    self.cancel_sequencer()
+                    for note in active_notes.values():
                         self.stop_note(note)
                     PLAY_EVENT.wait()
+                    self.start_clock(clock, self.playhead)
                 if RESTART_EVENT.is_set():
                     break
                 if KILL_EVENT.is_set():
                     sys.exit(0)
 
-                if song.dirty:
-                    event_index = song.get_next_index(self.playhead)
-                    if event_index >= len(song):
+                changed = schedule.update(feed)
+                if changed:
+                    clock.set_tempo_map(schedule.tempo_map, self.playhead)
+                    unit = schedule.ticks_per_unit
+                # The range touched by the last update says nothing about a
+                # new loop's events, so they are always rebuilt
+                loop_changed = self.loop != loop
+                if loop_changed:
+                    loop = self.loop
+                    # A new loop starts right away if the playhead is outside
+                    # of it
+                    if loop is not None and not (
+                        loop[0] <= self.playhead < loop[1]
+                    ):
+                        self.end_notes(active_notes, clock.deadline(send_time))
+                        clock.jump(send_time, loop[0])
+                        self.playhead = sent_time = loop[0]
+                        next_unit_time = loop[0] - (loop[0] % unit) + unit
+                if loop_changed or (
+                    changed and (loop is None or schedule.touches(*loop))
+                ):
+                    events = get_loop_events(schedule.events, loop)
+                    event_index = events.bisect_key_left(
+                        time_key(max(sent_time, self.playhead))
+                    )
+                    if event_index >= len(events):
                         break
-                    next_event = song[event_index]
-                    song.dirty = False
+                    next_event = events[event_index]
 
+                # Everything due at this tick is sent to the output at once
+                batch = []
+                deadline = clock.deadline(send_time)
+                wrap = False
                 while (
-                    event_index < len(song) and self.playhead == next_event.time
+                    event_index < len(events) and send_time == next_event.time
                 ):
-                    if isinstance(next_event, Note):
+                    if next_event.message is LOOP_END:
+                        wrap = True
+                        break
+                    if self.stats is not None:
+                        send_deadline = max(
+                            deadline - self.lookahead, clock.start_time
+                        )
+                        self.stats.lateness.record(
+                            perf_counter() - send_deadline
+                        )
+                    if next_event.is_note:
+                        key = next_event.channel, next_event.number
                         if next_event.on:
-                            active_notes.append(next_event)
-                        elif next_event.pair in active_notes:
-                            active_notes.remove(next_event.pair)
-                        self.play_note(next_event)
-                    elif isinstance(next_event, MessageEvent):
-                        if next_event.message.type == "pitchwheel":
-                            self.synth.pitch_bend(
-                                next_event.track.channel,
-                                next_event.message.pitch,
-                            )
-                        elif next_event.message.type == "control_change":
-                            self.synth.cc(
-                                next_event.track.channel,
-                                next_event.message.control,
-                                next_event.message.value,
-                            )
-                        elif next_event.message.type == "set_tempo":
-                            bpm = tempo2bpm(next_event.message.tempo)
+                            active_notes[key] = next_event
+                        else:
+                            active_notes.pop(key, None)
+                        if self.sequencer is not None:
+                            self.schedule_note(next_event, deadline)
+                        else:
+                            batch.append(next_event)
+                    elif next_event.channel is not None:
+                        batch.append(next_event)
                     event_index += 1
-                    if event_index < len(song):
-                        next_event = song[event_index]
+                    if event_index < len(events):
+                        next_event = events[event_index]
+                    sent_time = send_time + 1
+                if len(batch) > 0:
+                    # The sequencer does not support other messages, so they
+                    # are sent when they are due
+                    if self.sequencer is not None:
+                        clock.wait_until(deadline)
+                    self.send(batch)
 
-            for note in active_notes:
+                # Notes still playing at the end of the loop are stopped there,
+                # and the loop's start is due right when its end would be
+                if wrap:
+                    assert loop is not None
+                    self.end_notes(active_notes, deadline)
+                    clock.jump(loop[1], loop[0])
+                    if self.sequencer is None:
+                        self.playhead = loop[0]
+                    sent_time = loop[0]
+                    next_unit_time = loop[0] - (loop[0] % unit) + unit
+                    event_index = 0
+                    next_event = events[0]
+
+            # Notes sent ahead of the end of the song are still played, unless
+            # playback is starting over
+            if RESTART_EVENT.is_set():
+                self.cancel_sequencer()
+            else:
+                self.drain_sequencer()
+            for note in active_notes.values():
                 self.stop_note(note)
 
-    def try_play_song(self, song, crash_file_path):
+    # Plays a stream of events once from start to end, so that a song too long
+    # to load can be played while only the notes still playing are held. Each
+    # event comes with the ID of its note, which its on and off share, so
+    # that overlapping notes of the same pitch are all ended.
+    def play_events(
+        self,
+        events: Iterable[tuple[Hashable, ScheduledEvent]],
+        tempo_map: TempoMap,
+    ) -> None:
+        active_notes: dict[Hashable, ScheduledEvent] = {}
+        clock = Clock(tempo_map)
+        self.start_clock(clock, 0)
+        self.clock = clock
+        try:
+            for time, group in groupby(events, lambda item: item[1].time):
+                batch = []
+                for note_id, event in group:
+                    if event.is_note:
+                        if event.on:
+                            active_notes[note_id] = event
+                        else:
+                            active_notes.pop(note_id, None)
+                    if event.channel is not None:
+                        batch.append(event)
+                clock.wait(time)
+                if KILL_EVENT.is_set():
+                    break
+                self.playhead = time
+                if len(batch) > 0:
+                    self.send(batch)
+        finally:
+            self.end_notes(active_notes, perf_counter())
+
+    def try_play_song(self, feed, crash_file_path):
         try:
-            self.play_song(song)
+            self.play_song(feed)
         except Exception:
             with open(crash_file_path, "w") as crash_file:
                 crash_file.write(format_exc())
@@ -0,0 +1,612 @@
+from __future__ import annotations
+from array import array
+from collections import Counter
+from heapq import merge
+import json
+import mmap
+import os
+from struct import Struct, error as StructError
+from typing import Any, Iterator, Optional, TYPE_CHECKING
+
+from .feed import ADD, ScheduledEvent
+from .song import (
+    MessageEvent,
+    Note,
+    Song,
+    SongEvent,
+    TempoMap,
+    Track,
+    is_tempo_event,
+    sort_key,
+)
+
+if TYPE_CHECKING:
+    from .player import Player
+
+PROJECT_EXTENSION = ".mcli"
+
+# A project file is a header followed by sections, each of which starts with
+# a tag and the length of its data. Saving appends sections to the file, and
+# later sections take precedence over earlier ones when loading.
+MAGIC = b"MCLI"
+VERSION = 1
+HEADER = Struct("<4sHxx")
+SECTION_HEADER = Struct("<4s4xQ")
+
+# Settings, tracks and editor state, as JSON
+META = b"META"
+# The song's events as columns, in sorted order
+EVENTS = b"EVTS"
+# The messages of non-note events, as JSON
+MESSAGES = b"MSGS"
+# Notes added or removed since the events were written
+EDITS = b"EDIT"
+
+# Wider columns come first, so that every column stays aligned when the file
+# is memory-mapped
+EVENT_COLUMNS = ("q", "i", "H", "b", "B", "B")
+NO_TRACK = 0xFFFF
+NO_PAIR = -1
+
+# Action, track index, start time, duration, number and velocity
+EDIT_RECORD = Struct("<BHqqBB")
+
+# The number of events read at a time when streaming a project
+STREAM_WINDOW = 1 << 16
+
+# The errors that reading a corrupt file can raise, besides ValueError
+CORRUPT_ERRORS = (IndexError, KeyError, OverflowError, TypeError, StructError)
+
+
+def is_project(path: str) -> bool:
+    return path.lower().endswith(PROJECT_EXTENSION)
+
+
+# Sections are padded so that the next one starts on an 8-byte boundary
+def pack_section(tag: bytes, data: bytes) -> bytes:
+    padding = b"\0" * (-len(data) % 8)
+    return SECTION_HEADER.pack(tag, len(data)) + data + padding
+
+
+# The tag of each section, and where its data starts and how long it is
+def find_sections(view: Any) -> Iterator[tuple[bytes, int, int]]:
+    if len(view) < HEADER.size:
+        raise ValueError("Project file is truncated")
+    magic, version = HEADER.unpack_from(view)
+    if magic != MAGIC:
+        raise ValueError("Not a MusiCLI project file")
+    if version > VERSION:
+        raise ValueError(f"Unsupported project file version {version}")
+    position = HEADER.size
+    while position + SECTION_HEADER.size <= len(view):
+        tag, length = SECTION_HEADER.unpack_from(view, position)
+        position += SECTION_HEADER.size
+        # A section cut short by a crash during saving is ignored
+        if position + length > len(view):
+            break
+        yield tag, position, length
+        position += length + (-length % 8)
+
+
+def read_sections(view: memoryview) -> Iterator[tuple[bytes, memoryview]]:
+    for tag, position, length in find_sections(view):
+        yield tag, view[position : position + length]
+
+
+def pack_meta(song: Song, view_state: dict[str, Any]) -> bytes:
+    meta = {
+        "ticks_per_beat": song.ticks_per_beat,
+        "cols_per_beat": song.cols_per_beat,
+        "beats_per_measure": song.beats_per_measure,
+        "key": song.key,
+        "scale_name": song.scale_name,
+        "tracks": [[track.channel, track.instrument] for track in song.tracks],
+        "view": view_state,
+    }
+    return pack_section(META, json.dumps(meta).encode())
+
+
+def pack_events(song: Song) -> bytes:
+    # Holding every event keeps their IDs unique, even in compact mode
+    events = list(song.events)
+    indices = {id(event): index for index, event in enumerate(events)}
+    track_ids = {id(track): index for index, track in enumerate(song.tracks)}
+    columns = [array(code) for code in EVENT_COLUMNS]
+    times, pairs, tracks, numbers, velocities, on = columns
+    messages = []
+    for index, event in enumerate(events):
+        times.append(event.time)
+        tracks.append(track_ids.get(id(event.track), NO_TRACK))
+        if isinstance(event, Note):
+            pair = indices.get(id(event.pair)) if event.pair else None
+            pairs.append(NO_PAIR if pair is None else pair)
+            numbers.append(event.number)
+            velocities.append(event.velocity)
+            on.append(event.on)
+        else:
+            pairs.append(NO_PAIR)
+            numbers.append(-1)
+            velocities.append(0)
+            on.append(False)
+            assert isinstance(event, MessageEvent)
+            message = event.message
+            messages.append([index, message.is_meta, message.dict()])
+
+    data = bytearray(len(events).to_bytes(8, "little"))
+    for column in columns:
+        data += column.tobytes()
+        data += b"\0" * (-len(data) % 8)
+    return pack_section(EVENTS, bytes(data)) + pack_section(
+        MESSAGES, json.dumps(messages).encode()
+    )
+
+
+def unpack_events(
+    data: memoryview, messages: dict[int, Any], tracks: list[Track]
+) -> list[SongEvent]:
+    count = int.from_bytes(data[:8], "little")
+    columns = []
+    position = 8
+    try:
+        for code in EVENT_COLUMNS:
+            size = count * array(code).itemsize
+            columns.append(data[position : position + size].cast(code))
+            position += size + (-size % 8)
+        return read_events(count, columns, messages, tracks)
+    finally:
+        for column in columns:
+            column.release()
+
+
+def read_events(
+    count: int,
+    columns: list[memoryview],
+    messages: dict[int, Any],
+    tracks: list[Track],
+) -> list[SongEvent]:
+    times, pairs, track_ids, numbers, velocities, on = columns
+    events: list[SongEvent] = []
+    for index in range(count):
+        track_id = track_ids[index]
+        track = tracks[track_id] if track_id != NO_TRACK else None
+        if numbers[index] < 0:
+            events.append(MessageEvent(times[index], messages[index], track))
+            continue
+        note = Note(
+            bool(on[index]),
+            numbers[index],
+            times[index],
+            track,
+            velocities[index],
+        )
+        # Pairs are linked once the second note of the pair is reached
+        pair = pairs[index]
+        if NO_PAIR < pair < index:
+            pair_note = events[pair]
+            assert isinstance(pair_note, Note)
+            note.pair = pair_note
+            pair_note.pair = note
+        events.append(note)
+    return events
+
+
+def unpack_messages(data: memoryview) -> dict[int, Any]:
+    records = json.loads(bytes(data))
+    if len(records) == 0:
+        return {}
+    from mido import Message, MetaMessage
+
+    return {
+        index: (MetaMessage if is_meta else Message).from_dict(message)
+        for index, is_meta, message in records
+    }
+
+
+def apply_edits(song: Song, data: memoryview) -> int:
+    count = 0
+    for action, track_id, time, duration, number, velocity in (
+        EDIT_RECORD.iter_unpack(data)
+    ):
+        note = Note(
+            True, number, time, song.tracks[track_id], velocity, duration
+        )
+        if action == ADD:
+            song.add_note(note)
+        else:
+            song.remove_note(note, lookup=True)
+        count += 1
+    return count
+
+
+# Updates the song's settings and tracks in place, so that events already in
+# the song keep their tracks
+def apply_meta(
+    song: Song, meta: dict[str, Any], player: Optional[Player] = None
+) -> None:
+    song.ticks_per_beat = meta["ticks_per_beat"]
+    song.cols_per_beat = meta["cols_per_beat"]
+    song.beats_per_measure = meta["beats_per_measure"]
+    song.key = meta["key"]
+    song.scale_name = meta["scale_name"]
+    song.view_state = meta.get("view", {})
+    tracks = meta["tracks"]
+    del song.tracks[len(tracks) :]
+    for index, (channel, instrument) in enumerate(tracks):
+        if index < len(song.tracks):
+            track = song.tracks[index]
+            track.channel = channel
+            track.instrument = instrument
+        else:
+            track = Track(channel, instrument)
+            song.tracks.append(track)
+        if player is not None:
+            track.register(player)
+    song.tempo_dirty = True
+    song.dirty = True
+
+
+# Applies the sections of a project or journal file to the song, returning the
+# number of edits applied. The last settings are applied before any edits,
+# since edits may refer to tracks those settings add.
+def apply_sections(
+    song: Song,
+    view: memoryview,
+    player: Optional[Player] = None,
+    require_events: bool = False,
+) -> int:
+    # Every slice of the mapping must be released before it is closed, even
+    # if the file turns out to be corrupt
+    sections: list[memoryview] = []
+    try:
+        return apply_section_data(
+            song, read_sections(view), sections, player, require_events
+        )
+    finally:
+        for data in sections:
+            data.release()
+
+
+def apply_section_data(
+    song: Song,
+    section_data: Iterator[tuple[bytes, memoryview]],
+    sections: list[memoryview],
+    player: Optional[Player],
+    require_events: bool,
+) -> int:
+    meta: Optional[dict[str, Any]] = None
+    events: Optional[memoryview] = None
+    messages: Optional[memoryview] = None
+    edits = []
+    for tag, data in section_data:
+        sections.append(data)
+        if tag == META:
+            meta = json.loads(bytes(data))
+        elif tag == EVENTS:
+            events = data
+            messages = None
+            edits = []
+        elif tag == MESSAGES:
+            messages = data
+        elif tag == EDITS:
+            edits.append(data)
+    if require_events and (events is None or messages is None or meta is None):
+        raise ValueError("Project file has no song in it")
+
+    if meta is not None:
+        apply_meta(song, meta, player)
+    if events is not None and messages is not None:
+        song.set_events(
+            unpack_events(events, unpack_messages(messages), song.tracks)
+        )
+    return sum(apply_edits(song, data) for data in edits)
+
+
+def load_project(
+    path: str, player: Optional[Player] = None, compact: bool = False
+) -> Song:
+    song = Song(player=player, compact=compact)
+    with open(path, "rb") as file:
+        mapping = mmap.mmap(file.fileno(), 0, access=mmap.ACCESS_READ)
+    try:
+        with memoryview(mapping) as view:
+            edit_count = apply_sections(song, view, player, True)
+    except CORRUPT_ERRORS as e:
+        raise ValueError(f"Project file is corrupt: {e}")
+    finally:
+        mapping.close()
+
+    song.saved_path = path
+    song.saved_edit_count = edit_count
+    song.unsaved_edits = []
+    song.history.clear()
+    return song
+
+
+# Whether the file ends right after a complete section, which it does not if
+# an earlier save was cut short
+def ends_with_section(path: str) -> bool:
+    size = os.path.getsize(path)
+    if size < HEADER.size:
+        return False
+    with open(path, "rb") as file:
+        with mmap.mmap(file.fileno(), 0, access=mmap.ACCESS_READ) as mapping:
+            end = HEADER.size
+            try:
+                for _, position, length in find_sections(mapping):
+                    end = position + length + (-length % 8)
+            except ValueError:
+                return False
+    return end == size
+
+
+# Appends the edits made since the song was last saved to this file, unless
+# the song has changed too much for that, or the appended edits would take
+# longer to load than the song itself. Either way, the file is synced before
+# returning, since the journal of the saved edits is then reset.
+def save_project(
+    song: Song, path: str, view_state: Optional[dict[str, Any]] = None
+) -> bool:
+    if view_state is None:
+        view_state = song.view_state
+    edits = song.unsaved_edits
+    append = (
+        song.saved_path == path
+        and edits is not None
+        and song.saved_edit_count + len(edits) <= max(len(song), 1) // 2
+        and os.path.isfile(path)
+        and ends_with_section(path)
+    )
+    if append:
+        assert edits is not None
+        data = b"".join(EDIT_RECORD.pack(*edit) for edit in edits)
+        end = os.path.getsize(path)
+        try:
+            with open(path, "ab") as file:
+                file.write(
+                    pack_section(EDITS, data) + pack_meta(song, view_state)
+                )
+                file.flush()
+                os.fsync(file.fileno())
+        except OSError:
+            # A partly written section would hide the sections after it
+            os.truncate(path, end)
+            raise
+        song.saved_edit_count += len(edits)
+    else:
+        # Written to a temporary file first, so that a failed save does not
+        # leave the project half written
+        temp_path = path + ".tmp"
+        try:
+            with open(temp_path, "wb") as file:
+                file.write(HEADER.pack(MAGIC, VERSION))
+                file.write(pack_meta(song, view_state))
+                file.write(pack_events(song))
+                file.flush()
+                os.fsync(file.fileno())
+            os.replace(temp_path, path)
+        except BaseException:
+            try:
+                os.remove(temp_path)
+            except OSError:
+                pass
+            raise
+        song.saved_edit_count = 0
+
+    song.saved_path = path
+    song.unsaved_edits = []
+    song.view_state = view_state
+    return append
+
+
+# Identifies the note an edit applies to the way removing a note finds it:
+# by its start, channel and number
+NoteKey = tuple[int, int, int]
+
+
+# Plays a project straight from its file, reading events a window at a time
+# from the memory-mapped columns rather than loading the song. Pages that
+# have been read are dropped from memory, so memory use stays flat however
+# long the song is. Edits appended since the events were written are applied
+# as the events stream past, so only the edits themselves are kept.
+class ProjectStream:
+    mapping: mmap.mmap
+    ticks_per_beat: int
+    tracks: list[Track]
+    messages: dict[int, Any]
+    tempo_map: TempoMap
+    count: int
+    columns: list[tuple[int, str]]
+    added: list[tuple[int, ScheduledEvent]]
+    removed: Counter[NoteKey]
+
+    def __init__(self, path: str):
+        with open(path, "rb") as file:
+            self.mapping = mmap.mmap(file.fileno(), 0, access=mmap.ACCESS_READ)
+        try:
+            self.read_sections()
+        except CORRUPT_ERRORS as e:
+            self.mapping.close()
+            raise ValueError(f"Project file is corrupt: {e}")
+        except Exception:
+            self.mapping.close()
+            raise
+
+    def read_sections(self) -> None:
+        mapping = self.mapping
+        meta = None
+        events = None
+        messages = None
+        edits = []
+        for tag, position, length in find_sections(mapping):
+            data = slice(position, position + length)
+            if tag == META:
+                meta = json.loads(mapping[data])
+            elif tag == EVENTS:
+                events = position
+                messages = None
+                edits = []
+            elif tag == MESSAGES:
+                messages = mapping[data]
+            elif tag == EDITS:
+                edits.append(mapping[data])
+        if events is None or messages is None or meta is None:
+            raise ValueError("Project file has no song in it")
+
+        self.ticks_per_beat = meta["ticks_per_beat"]
+        self.tracks = [
+            Track(channel, instrument) for channel, instrument in meta["tracks"]
+        ]
+        self.count = int.from_bytes(mapping[events : events + 8], "little")
+        self.columns = []
+        position = events + 8
+        for code in EVENT_COLUMNS:
+            self.columns.append((position, code))
+            size = self.count * array(code).itemsize
+            position += size + (-size % 8)
+
+        # Messages are few enough to keep, and the tempo changes among them
+        # are needed to time every note
+        self.messages = unpack_messages(memoryview(messages))
+        times, code = self.columns[0]
+        size = array(code).itemsize
+        tempo_events = []
+        for index, message in sorted(self.messages.items()):
+            position = times + index * size
+            event = MessageEvent(
+                array(code, mapping[position : position + size])[0], message
+            )
+            if is_tempo_event(event):
+                tempo_events.append(event)
+        self.tempo_map = TempoMap(self.ticks_per_beat, tempo_events)
+        self.read_edits(edits)
+
+    # Notes that were added and then removed again cancel out, and the rest
+    # of the removed notes are skipped when they are read
+    def read_edits(self, edits: list[bytes]) -> None:
+        added: dict[NoteKey, list[tuple[int, int, int]]] = {}
+        self.removed = Counter()
+        for data in edits:
+            for action, track_id, time, duration, number, velocity in (
+                EDIT_RECORD.iter_unpack(data)
+            ):
+                key = time, self.tracks[track_id].channel, number
+                if action == ADD:
+                    added.setdefault(key, []).append(
+                        (track_id, duration, velocity)
+                    )
+                elif len(added.get(key, ())) > 0:
+                    added[key].pop()
+                else:
+                    self.removed[key] += 1
+
+        self.added = []
+        for (time, channel, number), notes in added.items():
+            for _, duration, velocity in notes:
+                note_id = -1 - len(self.added)
+                self.added.append(
+                    (
+                        note_id,
+                        ScheduledEvent(
+                            sort_key(time, number, True),
+                            time,
+                            channel,
+                            number,
+                            velocity,
+                            True,
+                            None,
+                        ),
+                    )
+                )
+                self.added.append(
+                    (
+                        note_id,
+                        ScheduledEvent(
+                            sort_key(time + duration, number, False),
+                            time + duration,
+                            channel,
+                            number,
+                            velocity,
+                            False,
+                            None,
+                        ),
+                    )
+                )
+        self.added.sort(key=lambda item: item[1].sort_key)
+
+    def close(self) -> None:
+        self.mapping.close()
+
+    def __enter__(self) -> ProjectStream:
+        return self
+
+    def __exit__(self, *_) -> None:
+        self.close()
+
+    # Events are yielded in order with the ID of the note they belong to,
+    # which is the index of its first event in the file
+    def __iter__(self) -> Iterator[tuple[int, ScheduledEvent]]:
+        return merge(
+            self.read_events(),
+            self.added,
+            key=lambda item: item[1].sort_key,
+        )
+
+    def read_events(self) -> Iterator[tuple[int, ScheduledEvent]]:
+        removed = Counter(self.removed)
+        # The other halves of removed notes
+        skipped = set()
+        channels = [track.channel for track in self.tracks]
+        for start in range(0, self.count, STREAM_WINDOW):
+            end = min(start + STREAM_WINDOW, self.count)
+            window = []
+            for offset, code in self.columns:
+                size = array(code).itemsize
+                data = self.mapping[offset + start * size : offset + end * size]
+                window.append(array(code, data))
+            for index, time, pair, track_id, number, velocity, on in zip(
+                range(start, end), *window
+            ):
+                channel = channels[track_id] if track_id != NO_TRACK else None
+                if number < 0:
+                    yield -1, ScheduledEvent(
+                        sort_key(time),
+                        time,
+                        channel,
+                        -1,
+                        0,
+                        False,
+                        self.messages[index],
+                    )
+                    continue
+                if index in skipped:
+                    skipped.remove(index)
+                    continue
+                assert channel is not None
+                if on and removed[time, channel, number] > 0:
+                    removed[time, channel, number] -= 1
+                    skipped.add(pair)
+                    continue
+                yield min(index, pair) if pair != NO_PAIR else index, (
+                    ScheduledEvent(
+                        sort_key(time, number, bool(on)),
+                        time,
+                        channel,
+                        number,
+                        velocity,
+                        bool(on),
+                        None,
+                    )
+                )
+            self.drop_pages(end)
+
+    # Drops the pages of every column up to the given event, which are read
+    # from the file again if they are ever needed
+    def drop_pages(self, end: int) -> None:
+        if not hasattr(mmap, "MADV_DONTNEED"):
+            return
+        for offset, code in self.columns:
+            start = offset - offset % mmap.PAGESIZE
+            stop = offset + end * array(code).itemsize
+            stop -= stop % mmap.PAGESIZE
+            if stop > start:
+                self.mapping.madvise(mmap.MADV_DONTNEED, start, stop - start)
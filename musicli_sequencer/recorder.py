@@ -0,0 +1,113 @@
+from __future__ import annotations
+from time import perf_counter
+from typing import Any, Optional, TYPE_CHECKING
+
+from .feed import EventRing, ScheduledEvent
+from .song import Note, Song, Track, sort_key
+
+if TYPE_CHECKING:
+    from .player import Player
+
+# Messages other than notes that are passed through to the synthesizer
+THRU_MESSAGES = frozenset(("control_change", "pitchwheel"))
+
+
+def get_input_names() -> list[str]:
+    from mido import get_input_names
+
+    return get_input_names()
+
+
+# Receives messages from a MIDI input port on the port's own thread. Notes are
+# played as soon as they arrive, and while recording, they are stamped with the
+# tick being played and queued for the song's thread, which adds them to the
+# song in batches once they end.
+class Recorder:
+    port: Any
+    name: str
+    player: Optional[Player]
+    channel: int
+    recording: bool
+    ring: EventRing
+    dropped: int
+    held: dict[int, tuple[int, int, Track]]
+
+    def __init__(self, name: Optional[str], player: Optional[Player] = None):
+        self.player = player
+        self.channel = 0
+        self.recording = False
+        self.ring = EventRing()
+        self.dropped = 0
+        self.held = {}
+
+        from mido import open_input
+
+        # Messages may arrive as soon as the port is open
+        self.port = open_input(name, callback=self.receive)
+        self.name = self.port.name
+
+    def close(self) -> None:
+        self.port.close()
+
+    # Called from the port's thread, so this does as little as possible
+    # before the note is played
+    def receive(self, message: Any) -> None:
+        time = perf_counter()
+        player = self.player
+        if message.type in ("note_on", "note_off"):
+            on = message.type == "note_on" and message.velocity > 0
+            tick = player.get_tick(time) if player is not None else 0
+            event = ScheduledEvent(
+                sort_key(tick, message.note, on),
+                tick,
+                self.channel,
+                message.note,
+                message.velocity,
+                on,
+                None,
+            )
+            if player is not None and player.ready:
+                player.play_note(event)
+            if self.recording and not self.ring.push(event):
+                self.dropped += 1
+        elif message.type in THRU_MESSAGES:
+            if player is not None and player.ready:
+                player.send_message(
+                    ScheduledEvent(0, 0, self.channel, -1, 0, False, message)
+                )
+
+    # Adds the notes that have ended since the last merge to the song as a
+    # single edit, returning them. Notes still held when recording stops are
+    # ended at the given tick.
+    def merge(
+        self, song: Song, track: Track, end: Optional[int] = None
+    ) -> list[Note]:
+        notes = []
+
+        def release(number: int, time: int) -> None:
+            start, velocity, note_track = self.held.pop(number)
+            if note_track in song.tracks:
+                notes.append(
+                    Note(
+                        True,
+                        number,
+                        start,
+                        note_track,
+                        velocity,
+                        duration=max(time - start, 1),
+                    )
+                )
+
+        for event in self.ring.drain():
+            if event.number in self.held:
+                release(event.number, event.time)
+            if event.on:
+                self.held[event.number] = event.time, event.velocity, track
+        if end is not None:
+            for number in list(self.held):
+                release(number, end)
+        # A note played again exactly over the same note is only kept once
+        notes = [note for note in notes if not song.has_note(note)]
+        if len(notes) > 0:
+            song.add_notes(notes)
+        return notes
@@ -0,0 +1,280 @@
+from __future__ import annotations
+from concurrent.futures import ProcessPoolExecutor
+from importlib.util import find_spec
+import os
+import os.path
+from tempfile import TemporaryDirectory
+import wave
+from typing import Iterable, Optional, Union, TYPE_CHECKING
+
+from .feed import ScheduledEvent
+from .output import FluidSynthOutput, SAMPLE_RATE
+from .player import IMPORT_FLUIDSYNTH, Player
+from .song import Song, TempoMap, Track
+
+if TYPE_CHECKING:
+    import soundfile
+
+# These are only imported once something is rendered. pyFluidSynth already
+# needs numpy to read samples from the synth.
+IMPORT_SOUNDFILE = find_spec("soundfile") is not None
+IMPORT_NUMPY = find_spec("numpy") is not None
+
+# Rendered audio is 16-bit stereo
+AUDIO_CHANNELS = 2
+SAMPLE_WIDTH = 2
+
+# The most frames read from the synth and passed to the encoder at once
+CHUNK_FRAMES = 4096
+
+# Keep rendering after the last event so that notes can ring out
+TAIL_SECONDS = 2.0
+
+
+class WavWriter:
+    file: wave.Wave_write
+
+    def __init__(self, path: str):
+        self.file = wave.open(path, "wb")
+        self.file.setnchannels(AUDIO_CHANNELS)
+        self.file.setsampwidth(SAMPLE_WIDTH)
+        self.file.setframerate(SAMPLE_RATE)
+
+    def write(self, data: bytes) -> None:
+        self.file.writeframesraw(data)
+
+    def close(self) -> None:
+        self.file.close()
+
+
+class SoundFileWriter:
+    file: soundfile.SoundFile
+
+    def __init__(self, path: str):
+        import soundfile
+
+        self.file = soundfile.SoundFile(
+            path,
+            "w",
+            samplerate=SAMPLE_RATE,
+            channels=AUDIO_CHANNELS,
+            subtype="PCM_16",
+        )
+
+    def write(self, data: bytes) -> None:
+        self.file.buffer_write(data, dtype="int16")
+
+    def close(self) -> None:
+        self.file.close()
+
+
+AudioWriter = Union[WavWriter, SoundFileWriter]
+
+
+def open_writer(path: str) -> AudioWriter:
+    extension = os.path.splitext(path)[1].lower()
+    if extension == ".wav":
+        return WavWriter(path)
+    if extension in (".flac", ".ogg"):
+        if not IMPORT_SOUNDFILE:
+            raise ValueError(
+                f"soundfile is required to render {extension} files "
+                "(pip install soundfile)"
+            )
+        return SoundFileWriter(path)
+    raise ValueError(
+        f"cannot render to {path}; use a .wav, .flac or .ogg file"
+    )
+
+
+def check_dependencies() -> None:
+    if not IMPORT_FLUIDSYNTH:
+        raise ValueError(
+            "pyfluidsynth is required to render songs (pip install "
+            "pyfluidsynth)"
+        )
+
+
+def load_player(soundfont: str) -> Player:
+    player = Player(FluidSynthOutput(soundfont, audio=False))
+    player.load()
+    if player.error is not None:
+        raise ValueError(player.error)
+    return player
+
+
+def to_frame(tempo_map: TempoMap, time: int) -> int:
+    return round(tempo_map.ticks_to_seconds(time) * SAMPLE_RATE)
+
+
+# The last frame to render, allowing notes to ring out after the last event
+def get_end_frame(song: Song) -> int:
+    if len(song) == 0:
+        return 0
+    end = to_frame(song.tempo_map, song[-1].time)
+    return end + round(TAIL_SECONDS * SAMPLE_RATE)
+
+
+# Reads the given number of frames from the synth into the writer
+def render_frames(player: Player, writer: AudioWriter, frames: int) -> None:
+    from fluidsynth import raw_audio_string
+
+    output = player.output
+    assert isinstance(output, FluidSynthOutput)
+    while frames > 0:
+        chunk = min(frames, CHUNK_FRAMES)
+        writer.write(raw_audio_string(output.synth.get_samples(chunk)))
+        frames -= chunk
+
+
+# Sends each event once its frame is reached, in the same order as playback
+def render_events(
+    player: Player,
+    events: Iterable[ScheduledEvent],
+    tempo_map: TempoMap,
+    writer: AudioWriter,
+    end_frame: int,
+) -> None:
+    rendered = 0
+    for event in events:
+        frame = to_frame(tempo_map, event.time)
+        if frame > rendered:
+            render_frames(player, writer, frame - rendered)
+            rendered = frame
+        if event.is_note:
+            player.play_note(event)
+        elif event.channel is not None:
+            player.send_message(event)
+    render_frames(player, writer, end_frame - rendered)
+
+
+# Renders the song as fast as the synth allows, returning the length of the
+# audio in seconds. The player should be created without audio.
+def render_song(song: Song, player: Player, path: str) -> float:
+    check_dependencies()
+    for track in song.tracks:
+        track.register(player)
+    end_frame = get_end_frame(song)
+    writer = open_writer(path)
+    try:
+        render_events(
+            player,
+            (event.to_scheduled() for event in song.events),
+            song.tempo_map,
+            writer,
+            end_frame,
+        )
+    finally:
+        writer.close()
+    return end_frame / SAMPLE_RATE
+
+
+# Renders a single track on a synth of its own; run in a separate process
+def render_stem(
+    soundfont: str,
+    track: Track,
+    events: list[ScheduledEvent],
+    tempo_map: TempoMap,
+    path: str,
+    end_frame: int,
+) -> None:
+    player = load_player(soundfont)
+    try:
+        track.register(player)
+        writer = WavWriter(path)
+        try:
+            render_events(player, events, tempo_map, writer, end_frame)
+        finally:
+            writer.close()
+    finally:
+        player.delete()
+
+
+# Adds the stems together, clipping any samples that overflow. Each stem was
+# already clipped to 16 bits on its own, so this is not the same as mixing
+# inside a single synth.
+def mix_stems(stem_paths: list[str], writer: AudioWriter) -> None:
+    import numpy
+
+    stems = [wave.open(path, "rb") for path in stem_paths]
+    try:
+        while True:
+            chunks = [stem.readframes(CHUNK_FRAMES) for stem in stems]
+            if len(chunks[0]) == 0:
+                break
+            mix = numpy.zeros(len(chunks[0]) // SAMPLE_WIDTH, numpy.int32)
+            for chunk in chunks:
+                mix += numpy.frombuffer(chunk, numpy.int16)
+            mix = numpy.clip(mix, -32768, 32767).astype(numpy.int16)
+            writer.write(mix.tobytes())
+    finally:
+        for stem in stems:
+            stem.close()
+
+
+def get_stem_path(stems_dir: str, index: int, track: Track) -> str:
+    name = str(track).replace(":", "").replace(os.sep, "-")
+    return os.path.join(stems_dir, f"{index + 1:02} {name}.wav")
+
+
+# Renders each track on its own synth, in up to the given number of processes
+# at once, then mixes the resulting stems into the given file. The stems are
+# kept if a directory is given for them. The mix can differ from render_song's
+# output: each synth applies its own reverb, chorus and polyphony limit, and
+# tracks on the same channel no longer share controller and pitch bend state.
+def render_song_stems(
+    song: Song,
+    soundfont: str,
+    path: str,
+    jobs: int = 1,
+    stems_dir: Optional[str] = None,
+) -> float:
+    check_dependencies()
+    if not IMPORT_NUMPY:
+        raise ValueError(
+            "numpy is required to mix rendered tracks (pip install numpy)"
+        )
+    tracks = [
+        track
+        for track in song.tracks
+        if len(song.get_track_events(track)) > 0
+    ]
+    if len(tracks) == 0:
+        player = load_player(soundfont)
+        try:
+            return render_song(song, player, path)
+        finally:
+            player.delete()
+    end_frame = get_end_frame(song)
+    if stems_dir is not None:
+        os.makedirs(stems_dir, exist_ok=True)
+
+    writer = open_writer(path)
+    try:
+        with TemporaryDirectory() as temp_dir:
+            stem_paths = [
+                get_stem_path(stems_dir or temp_dir, index, track)
+                for index, track in enumerate(tracks)
+            ]
+            with ProcessPoolExecutor(max_workers=jobs) as executor:
+                futures = [
+                    executor.submit(
+                        render_stem,
+                        soundfont,
+                        track,
+                        [
+                            event.to_scheduled()
+                            for event in song.get_track_events(track)
+                        ],
+                        song.tempo_map,
+                        stem_path,
+                        end_frame,
+                    )
+                    for track, stem_path in zip(tracks, stem_paths)
+                ]
+                for future in futures:
+                    future.result()
+            mix_stems(stem_paths, writer)
+    finally:
+        writer.close()
+    return end_frame / SAMPLE_RATE
@@ -0,0 +1,279 @@
+from __future__ import annotations
+import getpass
+import json
+import os
+import os.path
+import socket
+from socketserver import BaseRequestHandler
+import struct
+from tempfile import gettempdir
+from threading import Lock
+from typing import Any, Iterable, Optional
+
+from .feed import ScheduledEvent
+from .output import ALL_NOTES_OFF, FluidSynthOutput, Output
+from .song import MIDI_CHANNELS
+from .soundfont import load_preset_names
+
+# FluidSynth supports up to 256 channels, which are shared out to each
+# session in blocks of sixteen
+MAX_SESSIONS = 16
+
+# Each message is sent as its kind, its channel within the session's block of
+# channels, and up to two values
+RECORD = struct.Struct("<BBhh")
+NOTE_ON = 0
+NOTE_OFF = 1
+PROGRAM_SELECT = 2
+PITCH_BEND = 3
+CC = 4
+
+# The server greets each session with a line of JSON before any messages
+MAX_GREETING = 4096
+
+
+def get_default_socket() -> str:
+    directory = os.environ.get("XDG_RUNTIME_DIR") or gettempdir()
+    return os.path.join(directory, f"musicli-{getpass.getuser()}.sock")
+
+
+def check_unix_sockets() -> None:
+    if not hasattr(socket, "AF_UNIX"):
+        raise ValueError("Server mode requires Unix domain sockets")
+
+
+# Plays the messages of every connected editor on one synthesizer, so that the
+# soundfont is only loaded once. Each session's channels are offset into its
+# own block, and any notes it leaves playing are stopped when it disconnects.
+class Server:
+    path: str
+    output: FluidSynthOutput
+    sessions: list[bool]
+    lock: Lock
+    server: Any
+
+    def __init__(self, path: str, soundfont: str):
+        check_unix_sockets()
+        self.path = path
+        self.output = FluidSynthOutput(
+            soundfont, channels=MAX_SESSIONS * MIDI_CHANNELS
+        )
+        self.sessions = [False] * MAX_SESSIONS
+        self.lock = Lock()
+        self.server = None
+
+    # Raises ValueError if the soundfont cannot be loaded or another server
+    # is already listening on the socket
+    def start(self) -> None:
+        from socketserver import ThreadingUnixStreamServer
+
+        if os.path.exists(self.path):
+            probe = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            try:
+                probe.connect(self.path)
+            except OSError:
+                # Left behind by a server that did not exit cleanly
+                os.remove(self.path)
+            else:
+                raise ValueError(f"A server is already running on {self.path}")
+            finally:
+                probe.close()
+
+        self.output.load()
+        server = self
+
+        class Handler(BaseRequestHandler):
+            def handle(self) -> None:
+                server.run_session(self.request)
+
+        try:
+            self.server = ThreadingUnixStreamServer(self.path, Handler)
+        except OSError as e:
+            self.output.delete()
+            raise ValueError(f"Could not listen on {self.path}: {e}")
+        self.server.daemon_threads = True
+
+    def serve_forever(self) -> None:
+        self.server.serve_forever()
+
+    def close(self) -> None:
+        if self.server is not None:
+            self.server.server_close()
+            os.remove(self.path)
+        self.output.delete()
+
+    def open_session(self) -> Optional[int]:
+        with self.lock:
+            for index, used in enumerate(self.sessions):
+                if not used:
+                    self.sessions[index] = True
+                    return index
+        return None
+
+    def close_session(self, index: int) -> None:
+        offset = index * MIDI_CHANNELS
+        for channel in range(offset, offset + MIDI_CHANNELS):
+            self.output.cc(channel, ALL_NOTES_OFF, 0)
+        with self.lock:
+            self.sessions[index] = False
+
+    def run_session(self, connection: socket.socket) -> None:
+        index = self.open_session()
+        if index is None:
+            send_greeting(
+                connection,
+                {"error": f"The server already has {MAX_SESSIONS} sessions"},
+            )
+            return
+        try:
+            send_greeting(
+                connection,
+                {"session": index, "soundfont": self.output.soundfont_path},
+            )
+            offset = index * MIDI_CHANNELS
+            pending = b""
+            while True:
+                data = connection.recv(RECORD.size * 256)
+                if len(data) == 0:
+                    break
+                data = pending + data
+                end = len(data) - len(data) % RECORD.size
+                pending = data[end:]
+                for kind, channel, first, second in RECORD.iter_unpack(
+                    data[:end]
+                ):
+                    if channel < MIDI_CHANNELS:
+                        self.play(kind, channel + offset, first, second)
+        except OSError:
+            pass
+        finally:
+            self.close_session(index)
+
+    def play(self, kind: int, channel: int, first: int, second: int) -> None:
+        output = self.output
+        if kind == NOTE_ON:
+            output.note_on(channel, first, second)
+        elif kind == NOTE_OFF:
+            output.note_off(channel, first)
+        elif kind == PROGRAM_SELECT:
+            output.program_select(channel, first, second)
+        elif kind == PITCH_BEND:
+            output.pitch_bend(channel, first)
+        elif kind == CC:
+            output.cc(channel, first, second)
+
+
+def send_greeting(connection: socket.socket, greeting: dict) -> None:
+    connection.sendall(json.dumps(greeting).encode() + b"\n")
+
+
+# Plays through a server's synthesizer, so that the editor does not load the
+# soundfont itself. Every event due at once is sent in a single write. Writes
+# come from the playback, editor and recording threads, and are never
+# interleaved, since the server cannot find where a record starts again.
+class ServerOutput(Output):
+    path: str
+    connection: Optional[socket.socket]
+    lock: Lock
+
+    def __init__(self, path: str):
+        self.path = path
+        self.connection = None
+        self.lock = Lock()
+
+    def load(self) -> None:
+        check_unix_sockets()
+        connection = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        try:
+            connection.connect(self.path)
+            greeting = connection.makefile("rb").readline(MAX_GREETING)
+        except OSError as e:
+            connection.close()
+            raise ValueError(f"Could not connect to server at {self.path}: {e}")
+        try:
+            greeting = json.loads(greeting)
+        except ValueError:
+            greeting = {"error": f"No server is running on {self.path}"}
+        if "error" in greeting:
+            connection.close()
+            raise ValueError(greeting["error"])
+        self.connection = connection
+
+        # Instrument names are read from the server's soundfont if it is also
+        # readable here
+        try:
+            load_preset_names(greeting["soundfont"])
+        except (KeyError, OSError, ValueError):
+            pass
+
+    def delete(self) -> None:
+        with self.lock:
+            self.close()
+
+    def close(self) -> None:
+        if self.connection is not None:
+            self.connection.close()
+            self.connection = None
+
+    # Messages are dropped once the server has gone away
+    def write(self, data: bytes) -> None:
+        with self.lock:
+            if self.connection is None:
+                return
+            try:
+                self.connection.sendall(data)
+            except OSError:
+                self.close()
+
+    def note_on(self, channel: int, number: int, velocity: int) -> None:
+        self.write(RECORD.pack(NOTE_ON, channel, number, velocity))
+
+    def note_off(self, channel: int, number: int) -> None:
+        self.write(RECORD.pack(NOTE_OFF, channel, number, 0))
+
+    def program_select(self, channel: int, bank: int, program: int) -> None:
+        self.write(RECORD.pack(PROGRAM_SELECT, channel, bank, program))
+
+    def pitch_bend(self, channel: int, pitch: int) -> None:
+        self.write(RECORD.pack(PITCH_BEND, channel, pitch, 0))
+
+    def cc(self, channel: int, control: int, value: int) -> None:
+        self.write(RECORD.pack(CC, channel, control, value))
+
+    def send(self, events: Iterable[ScheduledEvent]) -> None:
+        records = []
+        for event in events:
+            record = pack_event(event)
+            if record is not None:
+                records.append(record)
+        if len(records) > 0:
+            self.write(b"".join(records))
+
+
+def pack_event(event: ScheduledEvent) -> Optional[bytes]:
+    assert event.channel is not None
+    if event.is_note:
+        if event.on:
+            return RECORD.pack(
+                NOTE_ON, event.channel, event.number, event.velocity
+            )
+        return RECORD.pack(NOTE_OFF, event.channel, event.number, 0)
+    message = event.message
+    if message.type == "pitchwheel":
+        return RECORD.pack(PITCH_BEND, event.channel, message.pitch, 0)
+    if message.type == "control_change":
+        return RECORD.pack(CC, event.channel, message.control, message.value)
+    return None
+
+
+def serve(path: str, soundfont: str) -> None:
+    server = Server(path, soundfont)
+    server.start()
+    print(f"Playing {soundfont} for up to {MAX_SESSIONS} editors on {path}")
+    print("Press Ctrl+C to stop")
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        server.close()
@@ -1,17 +1,34 @@
 from __future__ import annotations
-from bisect import bisect_left, bisect_right, insort
+from bisect import bisect_right
+from collections import deque
+from concurrent.futures import ProcessPoolExecutor
 from dataclasses import dataclass
-from typing import Optional, TYPE_CHECKING
+from heapq import merge
+from importlib.util import find_spec
+from io import BytesIO
+from itertools import repeat
+from operator import itemgetter
+from typing import Callable, Iterable, Iterator, Optional, TYPE_CHECKING
+
+from .eventlist import EventList
+from .feed import ADD, REMOVE, RING_CAPACITY, Feed, ScheduledEvent
+from .history import (
+    History,
+    MESSAGES_ADD,
+    TRACK_ADD,
+    TRACK_CHANNEL,
+    TRACK_INSTRUMENT,
+    TRACK_REMOVE,
+)
+from .midifile import ExportTrack, write_midi
+from .soundfont import PRESET_NAMES
 
 if TYPE_CHECKING:
+    from mido import Message
     import Player
 
-try:
-    from mido import Message, MidiFile, MidiTrack
-
-    IMPORT_MIDO = True
-except ImportError:
-    IMPORT_MIDO = False
+# mido is only imported once a MIDI file is read or written
+IMPORT_MIDO = find_spec("mido") is not None
 
 
 TOTAL_NOTES = 127
@@ -24,6 +41,7 @@ TOTAL_INSTRUMENTS = 128
 DEFAULT_CHANNEL = 0
 DEFAULT_BANK = 0
 
+MIDI_CHANNELS = 16
 DRUM_CHANNEL = 9
 DRUM_BANK = 128
 DRUM_INSTRUMENT = 0
@@ -339,21 +357,65 @@ DEFAULT_INSTRUMENT = 0
 DEFAULT_KEY = 0
 DEFAULT_SCALE_NAME = "major"
 
+MICROSECONDS_PER_MINUTE = 60_000_000
+
+
+def spell_note(number: int, letters: tuple[str, ...], octave: bool) -> str:
+    letter = letters[number % NOTES_PER_OCTAVE]
+    if not octave:
+        return letter
+    return f"{letter}{number // NOTES_PER_OCTAVE - 1}"
+
+
+# The name of every note in a spelling, without and with its octave
+def spell_notes(letters: tuple[str, ...]) -> tuple[tuple[str, ...], ...]:
+    return tuple(
+        tuple(
+            spell_note(number, letters, octave)
+            for number in range(TOTAL_NOTES + 1)
+        )
+        for octave in (False, True)
+    )
+
+
+# Names are looked up rather than built, since every visible note and sidebar
+# row is named each time the screen is drawn
+NOTE_NAMES = spell_notes(COMMON_NAMES)
+SHARP_NOTE_NAMES = spell_notes(SHARP_NAMES)
+FLAT_NOTE_NAMES = spell_notes(FLAT_NAMES)
+
+# The short and long drum name of every note, or its number if it has none
+DRUM_NOTE_NAMES: tuple[tuple[str, ...], ...] = tuple(
+    tuple(
+        (
+            DRUM_NAMES[number - DRUM_OFFSET][long]
+            if 0 <= number - DRUM_OFFSET < len(DRUM_NAMES)
+            else str(number)
+        )
+        for number in range(TOTAL_NOTES + 1)
+    )
+    for long in (0, 1)
+)
+
 
 def number_to_name(
     number: int, scale: Optional[str] = None, octave: bool = True
 ) -> str:
-    semitone = number % NOTES_PER_OCTAVE
     if scale in SHARP_KEYS:
-        letter = SHARP_NAMES[semitone]
+        letters, names = SHARP_NAMES, SHARP_NOTE_NAMES
     elif scale in FLAT_KEYS:
-        letter = FLAT_NAMES[semitone]
+        letters, names = FLAT_NAMES, FLAT_NOTE_NAMES
     else:
-        letter = COMMON_NAMES[semitone]
-    if not octave:
-        return letter
-    octave_str = number // NOTES_PER_OCTAVE - 1
-    return f"{letter}{octave_str}"
+        letters, names = COMMON_NAMES, NOTE_NAMES
+    if 0 <= number <= TOTAL_NOTES:
+        return names[octave][number]
+    return spell_note(number, letters, octave)
+
+
+def number_to_drum_name(number: int, long: bool = False) -> str:
+    if 0 <= number <= TOTAL_NOTES:
+        return DRUM_NOTE_NAMES[long][number]
+    return str(number)
 
 
 def name_to_number(name: str) -> int:
@@ -374,6 +436,10 @@ def name_to_number(name: str) -> int:
         raise ValueError(f"{name} is not a valid note name") from e
 
 
+def tempo_to_bpm(tempo: int) -> float:
+    return MICROSECONDS_PER_MINUTE / tempo
+
+
 class Track:
     channel: int
     instrument: int
@@ -394,7 +460,9 @@ class Track:
     def instrument_name(self) -> str:
         if self.is_drum:
             return "Drums"
-        return INSTRUMENT_NAMES[self.instrument]
+        return PRESET_NAMES.get(
+            (self.bank, self.instrument), INSTRUMENT_NAMES[self.instrument]
+        )
 
     def register(self, player: Player) -> None:
         player.set_instrument(self.channel, self.bank, self.instrument)
@@ -419,11 +487,24 @@ class Track:
         return hash(self.channel)
 
 
+# Events are ordered by time, then by note number (non-note events first), then
+# with off notes before on notes, all packed into one integer
+def sort_key(time: int, number: int = -1, on: bool = False) -> int:
+    return (time << 9) | ((number + 1) << 1) | on
+
+
+def time_key(time: int) -> int:
+    return sort_key(time)
+
+
 @dataclass(init=False)
 class SongEvent:
     time: int
     track: Track
 
+    # Position in the song's EventColumns, if it has any
+    slot = None
+
     def __init__(self, time: int, track: Track):
         if time < 0:
             raise ValueError(f"Time must be non-negative; was {time}")
@@ -431,11 +512,15 @@ class SongEvent:
         self.time = time
         self.track = track
 
+    @property
+    def sort_key(self) -> int:
+        return sort_key(self.time)
+
     def __lt__(self, other) -> bool:
-        return self.time < other.time
+        return self.sort_key < other.sort_key
 
     def __gt__(self, other) -> bool:
-        return self.time > other.time
+        return self.sort_key > other.sort_key
 
 
 @dataclass(init=False)
@@ -448,15 +533,9 @@ class BaseNote(SongEvent):
         super().__init__(time, track)
         self.number = number
 
-    def __lt__(self, other) -> bool:
-        if isinstance(other, BaseNote) and self.time == other.time:
-            return self.number < other.number
-        return super().__lt__(other)
-
-    def __gt__(self, other) -> bool:
-        if isinstance(other, BaseNote) and self.time == other.time:
-            return self.number > other.number
-        return super().__gt__(other)
+    @property
+    def sort_key(self) -> int:
+        return sort_key(self.time, self.number)
 
     def __repr__(self) -> str:
         return (
@@ -557,13 +636,7 @@ class Note(BaseNote):
 
     def name_in_key(self, key: Optional[str], octave: bool = False) -> str:
         if self.is_drum:
-            drum_number = self.number - DRUM_OFFSET
-            if 0 <= drum_number < len(DRUM_NAMES):
-                short_name, long_name = DRUM_NAMES[drum_number]
-            else:
-                short_name = str(self.number)
-                long_name = short_name
-            return long_name if octave else short_name
+            return number_to_drum_name(self.number, long=octave)
         return number_to_name(self.number, key, octave=octave)
 
     @property
@@ -581,8 +654,7 @@ class Note(BaseNote):
     @property
     def instrument_name(self) -> str:
         if self.is_drum:
-            _, drum_name = DRUM_NAMES[self.number - DRUM_OFFSET]
-            return drum_name
+            return number_to_drum_name(self.number, long=True)
         return self.track.instrument_name
 
     def move(self, time: int) -> None:
@@ -609,7 +681,7 @@ class Note(BaseNote):
             self.off_pair.time = self.on_pair.time + duration
 
     def set_velocity(self, velocity: int) -> None:
-        if not 0 <= velocity < MAX_VELOCITY:
+        if not 0 <= velocity <= MAX_VELOCITY:
             raise ValueError(
                 "Velocity must be in the range "
                 f"0-{MAX_VELOCITY}; was {velocity}"
@@ -619,14 +691,25 @@ class Note(BaseNote):
         if self.pair is not None:
             self.pair.velocity = velocity
 
-    def to_message(self, delta: int) -> Message:
-        message_type = "note_on" if self.on else "note_off"
-        return Message(
-            message_type,
-            note=self.number,
-            velocity=self.velocity,
-            time=delta,
-            channel=self.channel,
+    def set_number(self, number: int) -> None:
+        if not 0 <= number <= TOTAL_NOTES:
+            raise ValueError(
+                f"Note must be in the range 0-{TOTAL_NOTES}; was {number}"
+            )
+
+        self.number = number
+        if self.pair is not None:
+            self.pair.number = number
+
+    def to_scheduled(self) -> ScheduledEvent:
+        return ScheduledEvent(
+            self.sort_key,
+            self.time,
+            self.channel,
+            self.number,
+            self.velocity,
+            self.on,
+            None,
         )
 
     def __str__(self) -> str:
@@ -655,24 +738,9 @@ class Note(BaseNote):
     # where a note is played and then immediately stopped by the off event for
     # a note of the same pitch ending at the same time
     # (e.g. 2 back-to-back quarter notes of the same pitch)
-
-    def __lt__(self, other):
-        if (
-            isinstance(other, Note)
-            and self.time == other.time
-            and self.number == other.number
-        ):
-            return not self.on and other.on
-        return super().__lt__(other)
-
-    def __gt__(self, other):
-        if (
-            isinstance(other, Note)
-            and self.time == other.time
-            and self.number == other.number
-        ):
-            return self.on and not other.on
-        return super().__gt__(other)
+    @property
+    def sort_key(self) -> int:
+        return sort_key(self.time, self.number, self.on)
 
 
 class MessageEvent(SongEvent):
@@ -680,11 +748,11 @@ class MessageEvent(SongEvent):
         super().__init__(time, track)
         self.message = message
 
-    def to_message(self, delta):
-        self.message.time = delta
-        if self.track is not None:
-            self.message.channel = self.track.channel
-        return self.message
+    def to_scheduled(self) -> ScheduledEvent:
+        channel = self.track.channel if self.track is not None else None
+        return ScheduledEvent(
+            self.sort_key, self.time, channel, -1, 0, False, self.message
+        )
 
     def __repr__(self):
         return (
@@ -694,25 +762,357 @@ class MessageEvent(SongEvent):
         )
 
 
-def events_by_track(events):
-    tracks = {}
-    for event in events:
-        if event.track is not None:
-            if event.track not in tracks:
-                tracks[event.track] = []
-            tracks[event.track].append(event)
-    return tracks
+# Kinds of records read from a MIDI track
+RECORD_NOTE = 0
+RECORD_PROGRAM = 1
+RECORD_MESSAGE = 2
+
+
+def track_messages(track) -> Iterator[tuple[int, Message]]:
+    time = 0
+    for message in track:
+        time += message.time
+        yield time, message
+
+
+# Reads the events of one MIDI track into records of plain values, which are
+# sorted by time and can be sent between processes. Notes are paired with
+# note_off messages in the same track and channel, in the order they started.
+def read_track(track) -> list:
+    records = []
+    open_notes: dict[tuple[int, int], deque[list]] = {}
+    for time, message in track_messages(track):
+        if message.type == "note_on" and message.velocity > 0:
+            record = [
+                time,
+                RECORD_NOTE,
+                message.channel,
+                message.note,
+                message.velocity,
+                None,
+            ]
+            records.append(record)
+            open_notes.setdefault(
+                (message.channel, message.note), deque()
+            ).append(record)
+        elif message.type == "note_off" or (
+            message.type == "note_on" and message.velocity == 0
+        ):
+            notes = open_notes.get((message.channel, message.note))
+            if notes:
+                notes.popleft()[-1] = time
+        elif message.type == "program_change":
+            records.append(
+                (time, RECORD_PROGRAM, message.channel, message.program)
+            )
+        elif message.type in ("pitchwheel", "control_change"):
+            records.append((time, RECORD_MESSAGE, message.channel, message))
+        elif message.type == "set_tempo":
+            records.append((time, RECORD_MESSAGE, None, message))
+
+    # Notes that are never closed are dropped
+    if any(len(notes) > 0 for notes in open_notes.values()):
+        records = [
+            record
+            for record in records
+            if record[1] != RECORD_NOTE or record[-1] is not None
+        ]
+    return records
+
+
+# Splits a MIDI file into its header and its track chunks, without parsing the
+# tracks themselves
+def split_midi_tracks(data: bytes) -> tuple[bytes, list[bytes]]:
+    if data[:4] != b"MThd":
+        raise ValueError("File is not a MIDI file")
+    position = 8 + int.from_bytes(data[4:8], "big")
+    header = data[:position]
+    chunks = []
+    while position + 8 <= len(data):
+        length = int.from_bytes(data[position + 4 : position + 8], "big")
+        if data[position : position + 4] == b"MTrk":
+            chunks.append(data[position : position + 8 + length])
+        position += 8 + length
+    return header, chunks
+
+
+# Parses a single track chunk by giving it a header of its own
+def read_track_chunk(header: bytes, chunk: bytes) -> list:
+    from mido import MidiFile
+
+    header = header[:10] + (1).to_bytes(2, "big") + header[12:]
+    infile = MidiFile(file=BytesIO(header + chunk))
+    return read_track(infile.tracks[0])
+
+
+# Reads every track of a MIDI file into records, returning the file's ticks per
+# beat and the records in order of time
+def read_midi_records(path: str, jobs: int = 1) -> tuple[int, Iterator]:
+    if not IMPORT_MIDO:
+        raise ValueError(
+            "mido is required to import MIDI files (pip install mido)"
+        )
+    if jobs > 1:
+        with open(path, "rb") as infile:
+            header, chunks = split_midi_tracks(infile.read())
+        ticks_per_beat = int.from_bytes(header[12:14], "big")
+        with ProcessPoolExecutor(max_workers=jobs) as executor:
+            records = list(
+                executor.map(read_track_chunk, repeat(header), chunks)
+            )
+    else:
+        from mido import MidiFile
+
+        infile = MidiFile(path)
+        ticks_per_beat = infile.ticks_per_beat
+        records = list(map(read_track, infile.tracks))
+    return ticks_per_beat, merge(*records, key=itemgetter(0))
+
+
+def matches(event: SongEvent, note: bool = False, on: bool = False) -> bool:
+    return not (
+        (note and not isinstance(event, Note))
+        or (on and not (isinstance(event, Note) and event.on))
+    )
+
+
+# The following functions search a sorted list of events from a single track
+# or from the whole song
+def find_index(
+    events: EventList, time: int, note: bool = False, on: bool = False
+) -> int:
+    index = events.bisect_key_left(time_key(time))
+    if not 0 <= index < len(events) or time != events[index].time:
+        return len(events)
+    while (
+        index < len(events)
+        and events[index].time == time
+        and not matches(events[index], note, on)
+    ):
+        index += 1
+    return index
 
 
-def events_to_messages(events) -> Message:
-    messages = []
-    last_time = 0
+def find_previous_index(
+    events: EventList, time: int, note: bool = False, on: bool = False
+) -> int:
+    index = events.bisect_key_left(time_key(time)) - 1
+    if not 0 <= index < len(events) or time < events[index].time:
+        return len(events)
+    while index >= 0 and not matches(events[index], note, on):
+        index -= 1
+    return index
+
+
+def find_next_index(
+    events: EventList,
+    time: int,
+    note: bool = False,
+    on: bool = False,
+    inclusive: bool = True,
+) -> int:
+    time = max(time, 0)
+    if inclusive:
+        index = events.bisect_key_left(time_key(time))
+    else:
+        index = events.bisect_key_left(time_key(time + 1))
+    if not 0 <= index < len(events) or time > events[index].time:
+        return len(events)
+    while index < len(events) and not matches(events[index], note, on):
+        index += 1
+    return index
+
+
+def find_chord(events: EventList, index: int, step: int) -> list[Note]:
+    if not 0 <= index < len(events):
+        return []
+    chord_time = events[index].time
+    chord = [events[index]]
+    index += step
+    while 0 <= index < len(events) and events[index].time == chord_time:
+        if matches(events[index], on=True):
+            chord.append(events[index])
+        index += step
+    return chord
+
+
+# Notes are stored in the smallest bin that contains their entire span, where
+# the bins on each level are INTERVAL_BRANCHING times wider than the bins on
+# the level below, so a query only needs to check a few bins per level. Each
+# bin is further split into bands of note numbers, so that a query for a range
+# of notes mostly skips the notes outside of it.
+INTERVAL_BIN_TICKS = DEFAULT_TICKS_PER_BEAT
+INTERVAL_BRANCHING = 8
+INTERVAL_BAND_NOTES = NOTES_PER_OCTAVE
+
+
+class IntervalIndex:
+    bins: dict[tuple[int, int], dict[int, list]]
+    levels: int
+
+    def __init__(self):
+        self.bins = {}
+        self.levels = 0
+
+    # Subclasses may store something other than the notes themselves in each
+    # bin by overriding these methods
+
+    def new_bin(self):
+        return []
+
+    def to_item(self, note: Note):
+        return note
+
+    def to_event(self, item) -> Note:
+        return item
+
+    def is_match(self, item, note: Note) -> bool:
+        return item is note
+
+    def span(self, item) -> tuple[int, int]:
+        return item.start, item.end
+
+    @staticmethod
+    def get_bin(start: int, end: int) -> tuple[int, int]:
+        level = 0
+        size = INTERVAL_BIN_TICKS
+        while start // size != end // size:
+            level += 1
+            size *= INTERVAL_BRANCHING
+        return level, start // size
+
+    def add(self, note: Note) -> None:
+        key = self.get_bin(note.start, note.end)
+        bands = self.bins.get(key)
+        if bands is None:
+            bands = {}
+            self.bins[key] = bands
+        band = note.number // INTERVAL_BAND_NOTES
+        items = bands.get(band)
+        if items is None:
+            items = self.new_bin()
+            bands[band] = items
+        items.append(self.to_item(note))
+        self.levels = max(self.levels, key[0] + 1)
+
+    def remove(self, note: Note) -> None:
+        key = self.get_bin(note.start, note.end)
+        bands = self.bins.get(key, {})
+        band = note.number // INTERVAL_BAND_NOTES
+        items = bands.get(band, ())
+        for index, item in enumerate(items):
+            if self.is_match(item, note):
+                del items[index]
+                break
+        else:
+            raise ValueError(f"{note} is not in the interval index")
+        if len(items) == 0:
+            del bands[band]
+            if len(bands) == 0:
+                del self.bins[key]
+
+    # Yields every note that overlaps the range of time and has a number in the
+    # range of numbers, including the endpoints of both
+    def query(
+        self, start: int, end: int, low: int = 0, high: int = TOTAL_NOTES
+    ):
+        low_band = low // INTERVAL_BAND_NOTES
+        high_band = high // INTERVAL_BAND_NOTES
+        size = INTERVAL_BIN_TICKS
+        for level in range(self.levels):
+            for index in range(start // size, end // size + 1):
+                bands = self.bins.get((level, index))
+                if bands is None:
+                    continue
+                for band, items in bands.items():
+                    if not low_band <= band <= high_band:
+                        continue
+                    for item in items:
+                        item_start, item_end = self.span(item)
+                        if item_start <= end and item_end >= start:
+                            note = self.to_event(item)
+                            if low <= note.number <= high:
+                                yield note
+            size *= INTERVAL_BRANCHING
+
+
+def is_tempo_event(event: SongEvent) -> bool:
+    return (
+        isinstance(event, MessageEvent) and event.message.type == "set_tempo"
+    )
+
+
+class TempoMap:
+    ticks_per_beat: int
+    ticks: list[int]
+    seconds: list[float]
+    bpms: list[float]
+
+    # Tempo events must be sorted by time
+    def __init__(self, ticks_per_beat: int, tempo_events=()):
+        self.ticks_per_beat = ticks_per_beat
+        self.ticks = [0]
+        self.seconds = [0.0]
+        self.bpms = [DEFAULT_BPM]
+        for event in tempo_events:
+            bpm = tempo_to_bpm(event.message.tempo)
+            if event.time == self.ticks[-1]:
+                self.bpms[-1] = bpm
+            else:
+                self.seconds.append(self.ticks_to_seconds(event.time))
+                self.ticks.append(event.time)
+                self.bpms.append(bpm)
+
+    def index_at_ticks(self, ticks: int) -> int:
+        return max(bisect_right(self.ticks, ticks) - 1, 0)
+
+    def index_at_seconds(self, seconds: float) -> int:
+        return max(bisect_right(self.seconds, seconds) - 1, 0)
+
+    def bpm(self, ticks: int) -> float:
+        return self.bpms[self.index_at_ticks(ticks)]
+
+    def ticks_to_seconds(self, ticks: int) -> float:
+        index = self.index_at_ticks(ticks)
+        beats = (ticks - self.ticks[index]) / self.ticks_per_beat
+        return self.seconds[index] + beats / self.bpms[index] * 60.0
+
+    def seconds_to_ticks(self, seconds: float) -> int:
+        index = self.index_at_seconds(seconds)
+        beats = (seconds - self.seconds[index]) / 60.0 * self.bpms[index]
+        return self.ticks[index] + int(beats * self.ticks_per_beat)
+
+    def __len__(self) -> int:
+        return len(self.ticks)
+
+
+# The on notes of the given notes, each only once
+def get_unique_notes(notes: Iterable[Note]) -> list[Note]:
+    unique = {}
+    for note in notes:
+        if note.pair is None:
+            raise ValueError(f"Note {note} is unpaired")
+        unique[id(note.on_pair)] = note.on_pair
+    return list(unique.values())
+
+
+def group_by_track(
+    events: Iterable[SongEvent],
+) -> Iterator[tuple[Optional[Track], list[SongEvent]]]:
+    groups: dict[int, list[SongEvent]] = {}
     for event in events:
-        delta = event.time - last_time
-        if isinstance(event, (Note, MessageEvent)):
-            messages.append(event.to_message(delta))
-        last_time = event.time
-    return messages
+        groups.setdefault(id(event.track), []).append(event)
+    for track_events in groups.values():
+        yield track_events[0].track, track_events
+
+
+# Edited notes are only tracked individually up to this many at a time, after
+# which the whole song is considered changed
+MAX_CHANGES = 256
+
+# Edits since the last save are kept for appending to a project file until
+# there are this many, or as many as there are events in the song
+MAX_UNSAVED_EDITS = 4096
 
 
 class Song:
@@ -725,9 +1125,31 @@ class Song:
         beats_per_measure: int = DEFAULT_BEATS_PER_MEASURE,
         key: int = DEFAULT_KEY,
         scale_name: str = DEFAULT_SCALE_NAME,
+        compact: bool = False,
+        import_jobs: int = 1,
     ):
-        self.events = []
+        if compact:
+            # Imported here since the columns module depends on this one
+            from .columns import EventColumns
+
+            self.columns = EventColumns()
+        else:
+            self.columns = None
+
+        self.events = self.new_event_list()
         self.tracks = []
+        self.track_events = {}
+        self.intervals = self.new_interval_index()
+        self._tempo_map = None
+        self.tempo_dirty = True
+        self.changes = None
+        self.feed = None
+        self.journal = None
+        self.history = None
+        self.unsaved_edits = None
+        self.saved_path = None
+        self.saved_edit_count = 0
+        self.view_state = {}
 
         if ticks_per_beat is None:
             self.ticks_per_beat = DEFAULT_TICKS_PER_BEAT
@@ -735,7 +1157,7 @@ class Song:
             self.ticks_per_beat = ticks_per_beat
 
         if midi_file is not None:
-            self.import_midi(midi_file, player)
+            self.import_midi(midi_file, player, import_jobs)
         else:
             self.create_track(player=player)
 
@@ -744,6 +1166,8 @@ class Song:
         self.key = key
         self.scale_name = scale_name
 
+        # Importing the song is not a change that can be undone
+        self.history = History()
         self.dirty = True
 
     @property
@@ -755,8 +1179,13 @@ class Song:
         return SCALES[self.scale_name]
 
     @property
-    def events_by_track(self) -> list[SongEvent]:
-        return events_by_track(self.events)
+    def tempo_map(self) -> TempoMap:
+        if self.tempo_dirty or self._tempo_map is None:
+            self._tempo_map = TempoMap(
+                self.ticks_per_beat, filter(is_tempo_event, self.events)
+            )
+            self.tempo_dirty = False
+        return self._tempo_map
 
     @property
     def start(self) -> int:
@@ -778,35 +1207,296 @@ class Song:
     def cols_to_ticks(self, cols: int) -> int:
         return int(cols / self.cols_per_beat * self.ticks_per_beat)
 
+    def ticks_to_seconds(self, ticks: int) -> float:
+        return self.tempo_map.ticks_to_seconds(ticks)
+
+    def seconds_to_ticks(self, seconds: float) -> int:
+        return self.tempo_map.seconds_to_ticks(seconds)
+
+    def new_event_list(self, events=()) -> EventList:
+        if self.columns is None:
+            return EventList(events)
+        from .columns import ColumnarEventList
+
+        return ColumnarEventList(self.columns, events)
+
+    def new_interval_index(self) -> IntervalIndex:
+        if self.columns is None:
+            return IntervalIndex()
+        from .columns import ColumnarIntervalIndex
+
+        return ColumnarIntervalIndex(self.columns)
+
+    def get_track_events(self, track: Optional[Track]) -> EventList:
+        if track is None:
+            return self.events
+        events = self.track_events.get(id(track))
+        if events is None:
+            events = self.new_event_list()
+            self.track_events[id(track)] = events
+        return events
+
+    def set_events(self, events) -> None:
+        old_events = self.events
+        old_track_events = self.track_events.values()
+
+        self.events = self.new_event_list(events)
+        self.index_events()
+
+        # Clear old lists only after the new ones are built, so that events in
+        # both are never released from the song's columns
+        old_events.clear()
+        for events in old_track_events:
+            events.clear()
+        if self.columns is not None:
+            self.columns.compact_cache()
+        self.changes = None
+        self.unsaved_edits = None
+        if self.journal is not None:
+            self.journal.snapshot(self)
+        self.publish_snapshot()
+        self.dirty = True
+
+    def index_events(self) -> None:
+        track_events: dict[int, list[SongEvent]] = {
+            id(track): [] for track in self.tracks
+        }
+        self.intervals = self.new_interval_index()
+        for event in self.events:
+            if event.track is not None:
+                track_events.setdefault(id(event.track), []).append(event)
+            if isinstance(event, Note) and event.on and event.pair is not None:
+                self.intervals.add(event)
+        self.track_events = {
+            track_id: self.new_event_list(events)
+            for track_id, events in track_events.items()
+        }
+
+    def index(self, event: SongEvent, lookup: bool = False) -> int:
+        return self.events.index(event, lookup)
+
+    def to_song_index(self, events: EventList, index: int) -> int:
+        if events is self.events or index < 0:
+            return index
+        if index >= len(events):
+            return len(self)
+        return self.index(events[index])
+
     def add_note(self, note: Note, pair: bool = True) -> None:
-        index = bisect_left(self.events, note)
-        if (
-            0 <= index < len(self)
-            and self[index] == note
-            and (not pair or self[index].pair == note.pair)
-        ):
-            raise ValueError("Note {note} is already in the song")
-        self.events.insert(index, note)
+        if note in self.events:
+            existing = self[self.index(note, lookup=True)]
+            if not pair or existing.pair == note.pair:
+                raise ValueError("Note {note} is already in the song")
+        if pair and note.pair is None:
+            raise ValueError("Note {note} is unpaired")
+        track_events = self.get_track_events(note.track)
+        self.events.add(note)
+        track_events.add(note)
+        if pair:
+            self.events.add(note.pair)
+            track_events.add(note.pair)
+        if note.pair is not None and (pair or note.on):
+            self.intervals.add(note.on_pair)
+        self.mark_changed(note)
+        self.record_edit(ADD, note, pair)
         if pair:
-            if note.pair is None:
-                raise ValueError("Note {note} is unpaired")
-            insort(self.events, note.pair)
+            self.publish(
+                (ADD, note.to_scheduled()), (ADD, note.pair.to_scheduled())
+            )
+        else:
+            self.publish((ADD, note.to_scheduled()))
         self.dirty = True
 
+    def remove_event(self, event: SongEvent) -> None:
+        self.events.remove(event)
+        if event.track is not None:
+            self.get_track_events(event.track).remove(event)
+
     def remove_note(
         self, note: Note, pair: bool = True, lookup: bool = False
     ) -> None:
         # Get the song note rather than the given note, since externally
         # created notes may have different pairs
         if lookup:
-            note = self[self.events.index(note)]
-        self.events.remove(note)
+            note = self[self.index(note, lookup=True)]
+        if pair and note.pair is None:
+            raise ValueError("Note {song_note} is unpaired")
+        if note.pair is not None and (pair or note.on):
+            self.intervals.remove(note.on_pair)
+        self.mark_changed(note)
+        self.record_edit(REMOVE, note, pair)
+        self.remove_event(note)
         if pair:
-            if note.pair is None:
-                raise ValueError("Note {song_note} is unpaired")
-            self.events.remove(note.pair)
+            self.remove_event(note.pair)
+            self.publish(
+                (REMOVE, note.to_scheduled()),
+                (REMOVE, note.pair.to_scheduled()),
+            )
+        else:
+            self.publish((REMOVE, note.to_scheduled()))
         self.dirty = True
 
+    # Adds many notes as a single edit, merging them into each block of
+    # events once, rather than shifting a block for every note
+    def add_notes(self, notes: Iterable[Note], record: bool = True) -> None:
+        notes = get_unique_notes(notes)
+        self.check_new_notes(notes)
+        events = [event for note in notes for event in (note, note.pair)]
+        self.events.add_many(events)
+        for track, track_events in group_by_track(events):
+            self.get_track_events(track).add_many(track_events)
+        for note in notes:
+            self.intervals.add(note)
+            self.mark_changed(note)
+            if record:
+                self.record_edit(ADD, note)
+        self.publish(*((ADD, event.to_scheduled()) for event in events))
+        self.dirty = True
+
+    # Notes added together follow the same rule as add_note: a note cannot be
+    # added if the same note is already in the song or earlier in the batch
+    def check_new_notes(self, notes: list[Note]) -> None:
+        keys = set()
+        for note in notes:
+            key = note.start, note.duration, note.channel, note.number
+            if key in keys:
+                raise ValueError(f"Note {note} is already in the song")
+            keys.add(key)
+            if self.has_note(note):
+                raise ValueError(f"Note {note} is already in the song")
+
+    def has_note(self, note: Note) -> bool:
+        if note not in self.events:
+            return False
+        return self[self.index(note, lookup=True)].pair == note.pair
+
+    # Removes many notes as a single edit, returning their on notes
+    def remove_notes(
+        self, notes: Iterable[Note], record: bool = True
+    ) -> list[Note]:
+        notes = get_unique_notes(notes)
+        events = [event for note in notes for event in (note, note.pair)]
+        for note in notes:
+            self.intervals.remove(note)
+            self.mark_changed(note)
+            if record:
+                self.record_edit(REMOVE, note)
+        scheduled = [(REMOVE, event.to_scheduled()) for event in events]
+        self.events.remove_many(events)
+        for track, track_events in group_by_track(events):
+            self.get_track_events(track).remove_many(track_events)
+        self.publish(*scheduled)
+        self.dirty = True
+        return notes
+
+    # Changes many notes as a single edit: the notes are all taken out of the
+    # song, changed, then merged back in, so that each block of events is only
+    # rebuilt once however many notes are changed. If the change cannot be
+    # made, the notes are put back as they were without recording anything,
+    # so the song's history, unsaved edits and journal are left as they were.
+    def edit_notes(
+        self, notes: Iterable[Note], edit: Callable[[Note], None]
+    ) -> list[Note]:
+        notes = self.remove_notes(notes, record=False)
+        states = [
+            (note.start, note.duration, note.number, note.velocity)
+            for note in notes
+        ]
+        try:
+            for note in notes:
+                edit(note)
+            self.check_new_notes(notes)
+        except Exception:
+            for note, (start, duration, number, velocity) in zip(
+                notes, states
+            ):
+                note.move(start)
+                note.set_duration(duration)
+                note.set_number(number)
+                note.set_velocity(velocity)
+            self.add_notes(notes, record=False)
+            raise
+        for note, state in zip(notes, states):
+            self.record_note_edit(REMOVE, note, state)
+        self.add_notes(notes)
+        return notes
+
+    # Creates a feed for playing the song from another thread, which is kept up
+    # to date with every edit made to the song
+    def create_feed(self) -> Feed:
+        self.feed = Feed()
+        self.publish_snapshot()
+        return self.feed
+
+    def publish_snapshot(self) -> None:
+        if self.feed is not None:
+            self.feed.publish_snapshot(
+                (event.to_scheduled() for event in self.events),
+                self.tempo_map,
+                self.cols_to_ticks(1),
+            )
+
+    # If the feed cannot keep up, the rest of the edit is covered by a snapshot
+    def publish(self, *edits: tuple[int, ScheduledEvent]) -> None:
+        if self.feed is None:
+            return
+        for action, event in edits:
+            if not self.feed.publish(action, event):
+                self.publish_snapshot()
+                return
+
+    # Records the span of a note that was added or removed, or None once the
+    # whole song has changed
+    def mark_changed(self, note: Note) -> None:
+        if self.changes is None:
+            return
+        if note.pair is None or len(self.changes) >= MAX_CHANGES:
+            self.changes = None
+        else:
+            self.changes.append((note.start, note.end, note.number))
+
+    # Records an edit made since the song was last saved, so that a project
+    # file can be updated by appending it, so that it can be recovered from
+    # the journal, and so that it can be undone. Once the edits would take up
+    # more space than the song itself, the song is saved in full instead.
+    def record_edit(self, action: int, note: Note, pair: bool = True) -> None:
+        if not pair or note.pair is None:
+            self.unsaved_edits = None
+            if self.journal is not None:
+                self.journal.snapshot(self)
+            if self.history is not None:
+                self.history.clear()
+            return
+        on_note = note.on_pair
+        self.record_note_edit(
+            action,
+            on_note,
+            (on_note.time, on_note.duration, on_note.number, on_note.velocity),
+        )
+
+    # Records an edit of an on note as it was in the given start time,
+    # duration, number and velocity
+    def record_note_edit(
+        self, action: int, note: Note, state: tuple[int, int, int, int]
+    ) -> None:
+        if self.history is not None:
+            self.history.record(action, note, state)
+        if self.unsaved_edits is None and self.journal is None:
+            return
+        edit = (action, self.tracks.index(note.track), *state)
+        if self.unsaved_edits is not None:
+            if len(self.unsaved_edits) >= max(len(self), MAX_UNSAVED_EDITS):
+                self.unsaved_edits = None
+            else:
+                self.unsaved_edits.append(edit)
+        if self.journal is not None:
+            self.journal.record(edit)
+
+    def pop_changes(self) -> Optional[list[tuple[int, int, int]]]:
+        changes = self.changes
+        self.changes = []
+        return changes
+
     def move_note(self, note: Note, time: int) -> None:
         self.remove_note(note)
         note.move(time)
@@ -817,6 +1507,21 @@ class Song:
         note.set_duration(duration)
         self.add_note(note)
 
+    def set_velocity(self, note: Note, velocity: int) -> None:
+        notes = [note] if note.pair is None else [note, note.pair]
+        old_events = [note.to_scheduled() for note in notes]
+        self.record_edit(REMOVE, note)
+        note.set_velocity(velocity)
+        self.record_edit(ADD, note)
+        self.mark_changed(note)
+        for note in notes:
+            self.events.update(note)
+        self.publish(
+            *((REMOVE, event) for event in old_events),
+            *((ADD, note.to_scheduled()) for note in notes),
+        )
+        self.dirty = True
+
     def get_index(
         self,
         time: int,
@@ -824,25 +1529,8 @@ class Song:
         note: bool = False,
         on: bool = False,
     ) -> int:
-        dummy_track = track if track is not None else self.tracks[0]
-        dummy_note = BaseNote(time, dummy_track)
-        index = bisect_left(self, dummy_note)  # type: ignore
-        if not 0 <= index < len(self) or time != self[index].time:
-            return len(self)
-        while (
-            index < len(self)
-            and self[index].time == time
-            and (
-                (note and not isinstance(self[index], Note))
-                or (track is not None and self[index].track is not track)
-                or (
-                    on
-                    and not (isinstance(self[index], Note) and self[index].on)
-                )
-            )
-        ):
-            index += 1
-        return index
+        events = self.get_track_events(track)
+        return self.to_song_index(events, find_index(events, time, note, on))
 
     def get_previous_index(
         self,
@@ -851,18 +1539,9 @@ class Song:
         note: bool = False,
         on: bool = False,
     ) -> int:
-        dummy_track = track if track is not None else self.tracks[0]
-        dummy_note = BaseNote(time, dummy_track)
-        index = bisect_left(self, dummy_note) - 1  # type: ignore
-        if not 0 <= index < len(self) or time < self[index].time:
-            return len(self)
-        while index >= 0 and (
-            (note and not isinstance(self[index], Note))
-            or (track is not None and self[index].track is not track)
-            or (on and not (isinstance(self[index], Note) and self[index].on))
-        ):
-            index -= 1
-        return index
+        events = self.get_track_events(track)
+        index = find_previous_index(events, time, note, on)
+        return self.to_song_index(events, index)
 
     def get_next_index(
         self,
@@ -872,23 +1551,9 @@ class Song:
         on: bool = False,
         inclusive: bool = True,
     ) -> int:
-        time = max(time, 0)
-        dummy_track = track if track is not None else self.tracks[0]
-        if inclusive:
-            dummy_note = BaseNote(time, dummy_track)
-            index = bisect_left(self, dummy_note)  # type: ignore
-        else:
-            dummy_note = BaseNote(time, dummy_track, number=TOTAL_NOTES)
-            index = bisect_right(self, dummy_note)  # type: ignore
-        if not 0 <= index < len(self) or time > self[index].time:
-            return len(self)
-        while index < len(self) and (
-            (note and not isinstance(self[index], Note))
-            or (track is not None and self[index].track is not track)
-            or (on and not (isinstance(self[index], Note) and self[index].on))
-        ):
-            index += 1
-        return index
+        events = self.get_track_events(track)
+        index = find_next_index(events, time, note, on, inclusive)
+        return self.to_song_index(events, index)
 
     def get_note(
         self,
@@ -903,7 +1568,7 @@ class Song:
         self, time: int, track: Optional[Track] = None, on: bool = False
     ) -> Optional[Note]:
         index = self.get_previous_index(time, track, note=True, on=on)
-        return self[index] if index >= 0 else None
+        return self[index] if 0 <= index < len(self) else None
 
     def get_next_note(
         self,
@@ -922,66 +1587,60 @@ class Song:
         return self[index] if index < len(self) else None
 
     def get_chord(self, time: int, track: Optional[Track] = None) -> list[Note]:
-        index = self.get_index(time, track, on=True)
-        if not 0 <= index < len(self):
-            return []
-        chord_time = self[index].time
-        chord = [self[index]]
-        index += 1
-        while index < len(self) and self[index].time == chord_time:
-            if (
-                isinstance(self[index], Note)
-                and self[index].on
-                and (track is None or self[index].track is track)
-            ):
-                chord.append(self[index])
-            index += 1
-        return chord
+        events = self.get_track_events(track)
+        return find_chord(events, find_index(events, time, on=True), 1)
 
     def get_previous_chord(
         self, time: int, track: Optional[Track] = None
     ) -> list[Note]:
-        index = self.get_previous_index(time, track, on=True)
-        if not 0 <= index < len(self):
-            return []
-        chord_time = self[index].time
-        chord = [self[index]]
-        index -= 1
-        while index >= 0 and self[index].time == chord_time:
-            if (
-                isinstance(self[index], Note)
-                and self[index].on
-                and (track is None or self[index].track is track)
-            ):
-                chord.append(self[index])
-            index -= 1
-        return chord
+        events = self.get_track_events(track)
+        index = find_previous_index(events, time, on=True)
+        return find_chord(events, index, -1)
 
     def get_next_chord(
         self, time: int, track: Optional[Track] = None, inclusive: bool = True
     ) -> list[Note]:
-        index = self.get_next_index(time, track, on=True, inclusive=inclusive)
-        if not 0 <= index < len(self):
-            return []
-        chord_time = self[index].time
-        chord = [self[index]]
-        index += 1
-        while index < len(self) and self[index].time == chord_time:
-            if (
-                isinstance(self[index], Note)
-                and self[index].on
-                and (track is None or self[index].track is track)
-            ):
-                chord.append(self[index])
-            index += 1
-        return chord
+        events = self.get_track_events(track)
+        index = find_next_index(events, time, on=True, inclusive=inclusive)
+        return find_chord(events, index, 1)
+
+    def get_notes_in_range(
+        self,
+        start: int,
+        end: int,
+        track: Optional[Track] = None,
+        low: int = 0,
+        high: int = TOTAL_NOTES,
+    ) -> list[Note]:
+        return [
+            note
+            for note in self.intervals.query(start, end, low, high)
+            if track is None or note.track is track
+        ]
+
+    # The notes starting from the start time up to but not including the end
+    # time, or to the end of the song
+    def get_notes_starting_between(
+        self,
+        start: int,
+        end: Optional[int] = None,
+        track: Optional[Track] = None,
+    ) -> list[Note]:
+        events = self.get_track_events(track)
+        stop = None if end is None else events.bisect_key_left(sort_key(end))
+        return [
+            event
+            for event in events.islice(
+                events.bisect_key_left(sort_key(start)), stop
+            )
+            if isinstance(event, Note) and event.on and event.pair is not None
+        ]
 
     def get_events_in_track(self, track: Track, notes: bool = False):
-        events = []
-        for event in self.events:
-            if event.track is track and (not notes or isinstance(event, Note)):
-                events.append(event)
-        return events
+        events = self.get_track_events(track)
+        if notes:
+            return [event for event in events if isinstance(event, Note)]
+        return list(events)
 
     def has_channel(self, channel: int) -> bool:
         for track in self.tracks:
@@ -1009,6 +1668,10 @@ class Song:
         track = Track(channel, instrument)
         track.set_instrument(instrument, player)
         self.tracks.append(track)
+        self.track_events[id(track)] = self.new_event_list()
+        if self.history is not None:
+            self.history.record(TRACK_ADD, track, (len(self.tracks) - 1, []))
+        self.changed_tracks()
         self.dirty = True
         return track
 
@@ -1026,93 +1689,286 @@ class Song:
             return self.create_track(channel, instrument, player)
         return None
 
+    def set_track_channel(
+        self, track: Track, channel: int, player: Optional[Player] = None
+    ) -> None:
+        if self.history is not None:
+            self.history.record(TRACK_CHANNEL, track, (track.channel, channel))
+        track.set_channel(channel, player)
+        self.publish_snapshot()
+        self.changed_tracks()
+        self.dirty = True
+
+    def set_track_instrument(
+        self, track: Track, instrument: int, player: Optional[Player] = None
+    ) -> None:
+        if self.history is not None:
+            self.history.record(
+                TRACK_INSTRUMENT, track, (track.instrument, instrument)
+            )
+        track.set_instrument(instrument, player)
+        self.changed_tracks()
+        self.dirty = True
+
     def delete_track(self, track: Track) -> None:
-        i = 0
-        while i < len(self.events):
-            if self[i].track is track:
-                self.events.pop(i)
-            else:
-                i += 1
+        events = list(self.get_track_events(track))
+        index = self.tracks.index(track)
+        if self.history is not None:
+            self.history.record(TRACK_REMOVE, track, (index, events))
         self.tracks.remove(track)
-
-    def import_midi(self, infile_path: str, player: Optional[Player] = None):
-        if not IMPORT_MIDO:
-            raise ValueError(
-                "mido is required to import MIDI files (pip install mido)"
+        if len(events) > 0:
+            self.set_events(
+                [event for event in self.events if event.track is not track]
             )
-        infile = MidiFile(infile_path)
-        self.ticks_per_beat = infile.ticks_per_beat
+            return
+        # An empty track can be removed without rebuilding the song's events,
+        # but edits already recorded may still refer to it by index
+        del self.track_events[id(track)]
+        self.mark_tracks_moved()
+        self.dirty = True
+
+    # Puts a deleted track back at the given index along with its events, one
+    # at a time so that they keep their identity in compact mode
+    def insert_track(
+        self,
+        index: int,
+        track: Track,
+        events: list[SongEvent],
+        player: Optional[Player] = None,
+    ) -> None:
+        self.tracks.insert(index, track)
+        if player is not None:
+            track.register(player)
+        track_events = self.new_event_list()
+        self.track_events[id(track)] = track_events
+        messages = False
+        for event in events:
+            if isinstance(event, Note) and event.pair is not None:
+                if event.on:
+                    self.add_note(event)
+            else:
+                self.events.add(event)
+                track_events.add(event)
+                messages = True
+        if messages:
+            self.tempo_dirty = True
+            self.changes = None
+            self.publish_snapshot()
+        if messages or index < len(self.tracks) - 1:
+            self.mark_tracks_moved()
+        else:
+            self.changed_tracks()
+        self.dirty = True
+
+    # The journal writes the tracks along with the edits that refer to them by
+    # index, so it is told about new or changed tracks before any such edit
+    def changed_tracks(self) -> None:
+        if self.journal is not None:
+            self.journal.capture_meta(self)
+
+    # Unsaved edits refer to tracks by index, so they cannot be appended once
+    # tracks have moved, or once events besides notes have changed
+    def mark_tracks_moved(self) -> None:
+        self.unsaved_edits = None
+        if self.journal is not None:
+            self.journal.snapshot(self)
+
+    def import_midi(
+        self,
+        infile_path: str,
+        player: Optional[Player] = None,
+        jobs: int = 1,
+    ):
+        self.ticks_per_beat, records = read_midi_records(infile_path, jobs)
+
+        tracks: dict[int, Track] = {}
+
+        def get_track(channel: int) -> Track:
+            track = tracks.get(channel)
+            if track is None:
+                track = self.get_track(channel, create=True, player=player)
+                assert track is not None
+                tracks[channel] = track
+            return track
 
         events: list[SongEvent] = []
-        active_notes: list[Note] = []
-        for track in infile.tracks:
-            time = 0
-            for message in track:
-                time += message.time
-                if message.type == "note_on" and message.velocity > 0:
-                    track = self.get_track(
-                        message.channel, create=True, player=player
-                    )
-                    assert track is not None
-                    active_notes.append(
-                        Note(
-                            on=True,
-                            number=message.note,
-                            time=time,
-                            velocity=message.velocity,
-                            track=track,
-                        )
-                    )
-                elif message.type == "note_off" or (
-                    message.type == "note_on" and message.velocity == 0
-                ):
-                    for note in active_notes.copy():
-                        if note.number == message.note:
-                            duration = time - note.time
-                            note.set_duration(duration)
-                            events.append(note)
-                            assert note.pair is not None
-                            events.append(note.pair)
-                            active_notes.remove(note)
-                            break
-                elif message.type == "program_change":
-                    track = self.get_track(
-                        message.channel, create=True, player=player
-                    )
-                    track.set_instrument(message.program, player)
-                elif message.type in ("pitchwheel", "control_change"):
-                    track = self.get_track(
-                        message.channel, create=True, player=player
-                    )
-                    events.append(MessageEvent(time, message, track))
-                elif message.type == "set_tempo":
-                    events.append(MessageEvent(time, message))
+        for record in records:
+            time, kind, channel = record[:3]
+            if kind == RECORD_NOTE:
+                number, velocity, end = record[3:]
+                note = Note(
+                    on=True,
+                    number=number,
+                    time=time,
+                    velocity=velocity,
+                    track=get_track(channel),
+                    duration=end - time,
+                )
+                events.append(note)
+                assert note.pair is not None
+                events.append(note.pair)
+            elif kind == RECORD_PROGRAM:
+                get_track(channel).set_instrument(record[3], player)
+            elif channel is None:
+                events.append(MessageEvent(time, record[3]))
+            else:
+                events.append(
+                    MessageEvent(time, record[3], get_track(channel))
+                )
 
-        self.events = sorted(events)
-        self.dirty = True
+        self.tempo_dirty = True
+        self.set_events(events)
 
-    def export_midi(self, filename):
-        if not IMPORT_MIDO:
+    # Merges a MIDI file into the song at the given time, returning the new
+    # tracks. Each of the file's channels becomes a new track on a channel the
+    # song does not use yet, so that existing tracks keep their instruments.
+    # The file's events are merged into each block of the song's events once,
+    # rather than sorting the whole song again, and undoing the merge removes
+    # everything it added.
+    def merge_midi(
+        self,
+        infile_path: str,
+        offset: int = 0,
+        player: Optional[Player] = None,
+        jobs: int = 1,
+    ) -> list[Track]:
+        ticks_per_beat, records = read_midi_records(infile_path, jobs)
+        records = list(records)
+
+        # Times are converted to the song's ticks per beat
+        def to_ticks(time: int) -> int:
+            return offset + time * self.ticks_per_beat // ticks_per_beat
+
+        channels = sorted(
+            {
+                record[2]
+                for record in records
+                if record[1] != RECORD_PROGRAM and record[2] is not None
+            }
+        )
+        used_channels = {track.channel for track in self.tracks}
+        open_channels = [
+            channel
+            for channel in range(MIDI_CHANNELS)
+            if channel != DRUM_CHANNEL and channel not in used_channels
+        ]
+        melodic_channels = [
+            channel for channel in channels if channel != DRUM_CHANNEL
+        ]
+        if len(melodic_channels) > len(open_channels):
             raise ValueError(
-                "mido is required to export MIDI files (pip install mido)"
+                f"{infile_path} needs {len(melodic_channels)} channels, but "
+                f"only {len(open_channels)} are free"
             )
+        channel_map = dict(zip(melodic_channels, open_channels))
+        channel_map[DRUM_CHANNEL] = DRUM_CHANNEL
+        tracks = {
+            channel: Track(channel_map[channel], DEFAULT_INSTRUMENT)
+            for channel in channels
+        }
+        for track in tracks.values():
+            track.set_instrument(DEFAULT_INSTRUMENT, player)
+
+        notes: list[Note] = []
+        track_events: dict[int, list[SongEvent]] = {
+            channel: [] for channel in channels
+        }
+        messages: list[SongEvent] = []
+        for record in records:
+            time, kind, channel = record[:3]
+            if kind == RECORD_NOTE:
+                number, velocity, end = record[3:]
+                start = to_ticks(time)
+                note = Note(
+                    on=True,
+                    number=number,
+                    time=start,
+                    velocity=velocity,
+                    track=tracks[channel],
+                    duration=to_ticks(end) - start,
+                )
+                assert note.pair is not None
+                notes.append(note)
+                track_events[channel] += (note, note.pair)
+            elif kind == RECORD_PROGRAM:
+                if channel in tracks:
+                    tracks[channel].set_instrument(record[3], player)
+            elif channel is None:
+                messages.append(MessageEvent(to_ticks(time), record[3]))
+            else:
+                track_events[channel].append(
+                    MessageEvent(to_ticks(time), record[3], tracks[channel])
+                )
 
-        outfile = MidiFile(ticks_per_beat=self.ticks_per_beat)
-
-        for track, events in self.events_by_track.items():
-            midi_track = MidiTrack()
-            midi_track.append(
-                Message(
-                    "program_change",
-                    channel=track.channel,
-                    program=track.instrument,
+        events = [
+            event for channel in channels for event in track_events[channel]
+        ]
+        self.events.add_many(events)
+        for channel in channels:
+            track = tracks[channel]
+            self.tracks.append(track)
+            self.track_events[id(track)] = self.new_event_list(
+                track_events[channel]
+            )
+            if self.history is not None:
+                self.history.record(
+                    TRACK_ADD,
+                    track,
+                    (len(self.tracks) - 1, track_events[channel]),
                 )
+        for note in notes:
+            self.intervals.add(note)
+        self.changes = None
+        if len(messages) > 0:
+            self.add_messages(messages)
+        else:
+            self.mark_tracks_moved()
+            # More edits than the feed can hold are sent as a snapshot
+            if len(events) > RING_CAPACITY:
+                self.publish_snapshot()
+            else:
+                self.publish(*((ADD, event.to_scheduled()) for event in events))
+        self.dirty = True
+        return list(tracks.values())
+
+    # Adds events that belong to no track, such as tempo changes, which
+    # change how the whole song is played
+    def add_messages(self, events: list[SongEvent]) -> None:
+        self.events.add_many(events)
+        if self.history is not None:
+            self.history.record(MESSAGES_ADD, None, events)
+        self.changed_messages()
+
+    def remove_messages(self, events: list[SongEvent]) -> None:
+        self.events.remove_many(events)
+        self.changed_messages()
+
+    def changed_messages(self) -> None:
+        self.tempo_dirty = True
+        self.changes = None
+        self.mark_tracks_moved()
+        self.publish_snapshot()
+        self.dirty = True
+
+    # A copy of every track's events in order, which can be written to a MIDI
+    # file from another thread while the song is edited
+    def get_export_tracks(self) -> list[ExportTrack]:
+        tracks = {
+            id(track): (track.channel, track.instrument, [])
+            for track in self.tracks
+        }
+        conductor: ExportTrack = (None, None, [])
+        for event in self.events:
+            tracks.get(id(event.track), conductor)[2].append(
+                event.to_scheduled()
             )
-            for message in events_to_messages(events):
-                midi_track.append(message)
-            outfile.tracks.append(midi_track)
+        export_tracks = list(tracks.values())
+        if len(conductor[2]) > 0:
+            export_tracks.insert(0, conductor)
+        return export_tracks
 
-        outfile.save(filename)
+    def export_midi(self, filename: str) -> None:
+        write_midi(filename, self.ticks_per_beat, self.get_export_tracks())
 
     def __len__(self):
         return len(self.events)
@@ -1121,4 +1977,8 @@ class Song:
         return self.events[key]
 
     def __contains__(self, item):
-        return item in self.events
+        try:
+            self.index(item, lookup=True)
+        except ValueError:
+            return False
+        return True
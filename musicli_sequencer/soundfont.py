@@ -0,0 +1,51 @@
+from struct import unpack_from
+
+# Each preset header is a 20-byte name followed by the preset number, bank
+# number and 14 more bytes that are not needed here
+PRESET_HEADER_SIZE = 38
+
+# Names of the presets in the loaded soundfont, by bank and instrument number
+PRESET_NAMES: dict[tuple[int, int], str] = {}
+
+
+def read_chunk_header(file) -> tuple[bytes, int]:
+    header = file.read(8)
+    if len(header) < 8:
+        return b"", 0
+    return header[:4], int.from_bytes(header[4:], "little")
+
+
+# Reads the names of the presets in an SF2 soundfont without loading it, by
+# skipping over everything but the preset headers (including the samples,
+# which make up nearly all of the file)
+def read_preset_names(path: str) -> dict[tuple[int, int], str]:
+    with open(path, "rb") as file:
+        chunk_id, size = read_chunk_header(file)
+        if chunk_id != b"RIFF" or file.read(4) != b"sfbk":
+            raise ValueError(f"{path} is not an SF2 soundfont")
+        while True:
+            chunk_id, size = read_chunk_header(file)
+            if chunk_id == b"":
+                raise ValueError(f"{path} has no preset headers")
+            if chunk_id == b"LIST":
+                # Subchunks of lists are read as if they were top-level chunks
+                file.read(4)
+                continue
+            if chunk_id == b"phdr":
+                data = file.read(size)
+                break
+            file.seek(size + (size & 1), 1)
+
+    names = {}
+    # The last header only marks the end of the list
+    for offset in range(0, len(data) - PRESET_HEADER_SIZE, PRESET_HEADER_SIZE):
+        raw_name, instrument, bank = unpack_from("<20sHH", data, offset)
+        name = raw_name.split(b"\0", 1)[0].decode("latin-1").strip()
+        if len(name) > 0:
+            names[bank, instrument] = name
+    return names
+
+
+def load_preset_names(path: str) -> None:
+    PRESET_NAMES.clear()
+    PRESET_NAMES.update(read_preset_names(path))
@@ -0,0 +1,81 @@
+from bisect import bisect_left
+from typing import Iterator, TextIO
+
+# Upper bounds of the histogram buckets, in seconds (0.1 ms to about 0.2 s),
+# followed by one bucket for anything slower
+BUCKET_SECONDS = [0.0001 * 2**exponent for exponent in range(12)]
+
+
+class Stat:
+    name: str
+    count: int
+    total: float
+    max: float
+    buckets: list[int]
+
+    def __init__(self, name: str):
+        self.name = name
+        self.reset()
+
+    def reset(self) -> None:
+        self.count = 0
+        self.total = 0.0
+        self.max = 0.0
+        self.buckets = [0] * (len(BUCKET_SECONDS) + 1)
+
+    def record(self, seconds: float) -> None:
+        self.count += 1
+        self.total += seconds
+        self.max = max(self.max, seconds)
+        self.buckets[bisect_left(BUCKET_SECONDS, seconds)] += 1
+
+    @property
+    def mean(self) -> float:
+        return self.total / self.count if self.count > 0 else 0.0
+
+    @property
+    def summary(self) -> str:
+        return f"{self.mean * 1000:.1f}/{self.max * 1000:.1f}"
+
+    def format_histogram(self) -> str:
+        lines = [f"{self}, {self.count} samples"]
+        width = max(max(self.buckets), 1)
+        for index, count in enumerate(self.buckets):
+            if index < len(BUCKET_SECONDS):
+                label = f"< {BUCKET_SECONDS[index] * 1000:.1f} ms"
+            else:
+                label = f">= {BUCKET_SECONDS[-1] * 1000:.1f} ms"
+            bar = "#" * round(count / width * 40)
+            lines.append(f"  {label:>12} {count:>8} {bar}".rstrip())
+        return "\n".join(lines)
+
+    def __str__(self) -> str:
+        return (
+            f"{self.name}: {self.mean * 1000:.2f} ms avg, "
+            f"{self.max * 1000:.2f} ms max"
+        )
+
+
+class Stats:
+    draw: Stat
+    input: Stat
+    lateness: Stat
+    synth: Stat
+
+    def __init__(self):
+        self.draw = Stat("Draw")
+        self.input = Stat("Input")
+        self.lateness = Stat("Lateness")
+        self.synth = Stat("Synth")
+
+    def __iter__(self) -> Iterator[Stat]:
+        return iter((self.draw, self.input, self.lateness, self.synth))
+
+    def __str__(self) -> str:
+        summaries = " ".join(f"{stat.name} {stat.summary}" for stat in self)
+        return f"{summaries} ms"
+
+    def write(self, file: TextIO) -> None:
+        for stat in self:
+            file.write(stat.format_histogram())
+            file.write("\n\n")
@@ -0,0 +1,46 @@
+from musicli_sequencer.song import DEFAULT_VELOCITY, Note, Song
+
+# Length in ticks of the notes made for tests
+NOTE_DURATION = 120
+
+
+# Every note in a song as a tuple that can be compared between songs
+def dump(song: Song) -> list[tuple]:
+    return [
+        (
+            song.tracks.index(note.track),
+            note.time,
+            note.duration,
+            note.number,
+            note.velocity,
+        )
+        for note in song.get_notes_starting_between(0)
+    ]
+
+
+def make_note(
+    song: Song,
+    time: int,
+    number: int = 60,
+    track_index: int = 0,
+    velocity: int = DEFAULT_VELOCITY,
+    duration: int = NOTE_DURATION,
+) -> Note:
+    return Note(
+        True,
+        number,
+        time,
+        song.tracks[track_index],
+        velocity=velocity,
+        duration=duration,
+    )
+
+
+# Adds a note as its own edit, which can be undone on its own
+def add_note(
+    song: Song, time: int, number: int = 60, track_index: int = 0
+) -> Note:
+    note = make_note(song, time, number, track_index)
+    song.add_note(note)
+    song.history.commit()
+    return note
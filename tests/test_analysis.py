@@ -0,0 +1,74 @@
+from time import sleep
+import unittest
+
+from musicli_sequencer.analysis import (
+    Analyzer,
+    analyze_track,
+    get_track_columns,
+)
+from musicli_sequencer.song import NOTES_PER_OCTAVE, Song
+
+from helpers import make_note
+
+
+class AnalyzerTest(unittest.TestCase):
+    def setUp(self):
+        self.song = Song()
+        self.track = self.song.tracks[0]
+        self.analyzer = Analyzer()
+        self.measure = self.song.beats_to_ticks(self.song.beats_per_measure)
+
+    def add(self, time: int, number: int) -> None:
+        self.song.add_note(make_note(self.song, time, number, velocity=64))
+
+    def analyze(self) -> None:
+        self.analyzer.invalidate(self.song, self.song.pop_changes())
+        self.analyzer.edit_time = 0.0
+        self.analyzer.start(self.song)
+        while not self.analyzer.receive():
+            sleep(0.001)
+
+    def expected(self) -> dict:
+        notes = self.song.get_notes_starting_between(0, None, self.track)
+        semitones = frozenset(
+            (number + self.song.key) % NOTES_PER_OCTAVE
+            for number in self.song.scale
+        )
+        return analyze_track(
+            get_track_columns(notes), self.measure, semitones, False
+        )
+
+    def test_window_stats(self):
+        self.add(0, 60)
+        self.add(120, 61)
+        self.add(self.measure, 72)
+        self.analyze()
+        results = self.analyzer.get_results(self.track)
+        self.assertEqual(sorted(results), [0, 1])
+        self.assertEqual(results[0].notes, 2)
+        self.assertEqual((results[0].low, results[0].high), (60, 61))
+        self.assertEqual(results[0].out_of_scale, 1)
+        self.assertEqual(results[1].notes, 1)
+        self.assertEqual(self.analyzer.get_summary(self.track).notes, 3)
+
+    # Only the measures that were edited are analyzed again, and the results
+    # match analyzing the whole track
+    def test_incremental(self):
+        for measure in range(4):
+            self.add(measure * self.measure, 60 + measure)
+        self.analyze()
+        self.add(2 * self.measure + 240, 66)
+        self.analyze()
+        self.assertEqual(self.analyzer.get_results(self.track), self.expected())
+
+    def test_scale_change(self):
+        self.add(0, 61)
+        self.analyze()
+        self.song.key = 1
+        self.analyze()
+        results = self.analyzer.get_results(self.track)
+        self.assertEqual(results[0].out_of_scale, 0)
+
+
+if __name__ == "__main__":
+    unittest.main()
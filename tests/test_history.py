@@ -0,0 +1,63 @@
+import unittest
+from unittest.mock import patch
+
+from musicli_sequencer.song import DEFAULT_VELOCITY, Note, Song
+
+from helpers import add_note, dump
+
+
+class HistoryTest(unittest.TestCase):
+    def setUp(self):
+        self.song = Song()
+
+    def add(self) -> Note:
+        return add_note(self.song, 0)
+
+    def round_trip(self, before: list[tuple]) -> None:
+        after = dump(self.song)
+        self.song.history.undo(self.song)
+        self.assertEqual(dump(self.song), before)
+        self.song.history.redo(self.song)
+        self.assertEqual(dump(self.song), after)
+
+    def test_add(self):
+        self.add()
+        self.assertEqual(dump(self.song)[0][4], DEFAULT_VELOCITY)
+        self.round_trip([])
+
+    def test_remove(self):
+        note = self.add()
+        before = dump(self.song)
+        self.song.remove_note(note)
+        self.song.history.commit()
+        self.round_trip(before)
+
+    def test_move(self):
+        note = self.add()
+        before = dump(self.song)
+        self.song.move_note(note, 480)
+        self.song.history.commit()
+        self.round_trip(before)
+
+    def test_velocity(self):
+        note = self.add()
+        before = dump(self.song)
+        self.song.set_velocity(note, 64)
+        self.song.history.commit()
+        self.round_trip(before)
+        self.song.set_velocity(note, DEFAULT_VELOCITY)
+        self.assertEqual(dump(self.song)[0][4], DEFAULT_VELOCITY)
+
+    # Redone steps count towards the limits the same as committed ones
+    def test_redo_limit(self):
+        for time in range(0, 480, 120):
+            add_note(self.song, time)
+        self.song.history.undo(self.song)
+        with patch("musicli_sequencer.history.MAX_UNDO_STEPS", 2):
+            self.song.history.redo(self.song)
+        self.assertEqual(len(self.song.history.undo_steps), 2)
+        self.assertEqual(self.song.history.size, 2)
+
+
+if __name__ == "__main__":
+    unittest.main()
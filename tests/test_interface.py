@@ -0,0 +1,59 @@
+import curses
+from time import perf_counter
+from typing import Union
+import unittest
+
+from musicli_sequencer.interface import Interface
+
+
+class FakeWindow:
+    def __init__(self, keys: Union[str, list[int]]):
+        self.codes = [ord(key) if isinstance(key, str) else key for key in keys]
+
+    def timeout(self, delay: int) -> None:
+        pass
+
+    def getch(self) -> int:
+        return self.codes.pop(0) if len(self.codes) > 0 else curses.ERR
+
+
+# Records the keys handled and the repeat count each was handled with, rather
+# than drawing an interface
+class PendingInputTest(unittest.TestCase):
+    def handle(self, keys: Union[str, list[int]]) -> list[tuple[int, int]]:
+        interface = Interface.__new__(Interface)
+        interface.window = FakeWindow(keys)
+        interface.insert = False
+        interface.prompt = None
+        interface.repeat_count = 0
+        handled = []
+
+        def handle_input(input_code: int) -> bool:
+            handled.append((input_code, interface.repeat_count))
+            interface.repeat_count = 0
+            return True
+
+        interface.handle_input = handle_input
+        interface.handle_pending_input(perf_counter() + 60)
+        return handled
+
+    def test_pan(self):
+        self.assertEqual(self.handle("lllh"), [(ord("l"), 3), (ord("h"), 0)])
+
+    def test_arrows(self):
+        keys = [curses.KEY_LEFT] * 4 + [curses.KEY_UP] * 2
+        self.assertEqual(
+            self.handle(keys), [(curses.KEY_LEFT, 4), (curses.KEY_UP, 2)]
+        )
+
+    # Zero jumps to the start of the song, but would be read as part of the
+    # repeat count if one were set
+    def test_zeros(self):
+        self.assertEqual(self.handle("000"), [(ord("0"), 0)] * 3)
+
+    def test_edits(self):
+        self.assertEqual(self.handle("xx"), [(ord("x"), 0)] * 2)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,165 @@
+import os
+import tempfile
+from typing import Optional
+import unittest
+
+from musicli_sequencer.feed import ScheduledEvent
+from musicli_sequencer.midifile import encode_track, write_midi
+from musicli_sequencer.song import IMPORT_MIDO, sort_key
+
+END_OF_TRACK = bytes((0x00, 0xFF, 0x2F, 0x00))
+
+
+# Stands in for a mido message, so that the bytes written can be checked
+# without mido
+class FakeMessage:
+    raw: bytes
+    is_meta: bool
+
+    def __init__(self, raw: bytes):
+        self.raw = raw
+        self.is_meta = raw[0] == 0xFF
+
+    def bytes(self) -> list[int]:
+        return list(self.raw)
+
+
+def note(time: int, number: int, on: bool, channel: int = 0) -> ScheduledEvent:
+    return ScheduledEvent(
+        sort_key(time, number, on), time, channel, number, 100, on, None
+    )
+
+
+def message(
+    time: int, raw: bytes, channel: Optional[int] = None
+) -> ScheduledEvent:
+    return ScheduledEvent(
+        sort_key(time), time, channel, -1, 0, False, FakeMessage(raw)
+    )
+
+
+# The bytes of a track's events, without its header or end
+def encode_body(
+    events: list[ScheduledEvent],
+    channel: Optional[int] = None,
+    program: Optional[int] = None,
+) -> bytes:
+    chunk = encode_track(channel, program, events)
+    assert chunk[:4] == b"MTrk"
+    assert int.from_bytes(chunk[4:8], "big") == len(chunk) - 8
+    assert chunk.endswith(END_OF_TRACK)
+    return chunk[8 : -len(END_OF_TRACK)]
+
+
+class EncodeTrackTest(unittest.TestCase):
+    # Note offs are note ons without velocity, so a run of notes on a channel
+    # needs only one status byte
+    def test_running_status(self):
+        events = [note(0, 60, True), note(120, 60, False), note(120, 62, True)]
+        self.assertEqual(
+            encode_body(events),
+            bytes((0x00, 0x90, 60, 100, 0x78, 60, 0, 0x00, 62, 100)),
+        )
+
+    def test_program(self):
+        self.assertEqual(
+            encode_body([note(0, 60, True, 3)], 3, 5),
+            bytes((0x00, 0xC3, 5, 0x00, 0x93, 60, 100)),
+        )
+
+    def test_channels(self):
+        events = [note(0, 60, True, 0), note(0, 60, True, 1)]
+        self.assertEqual(
+            encode_body(events),
+            bytes((0x00, 0x90, 60, 100, 0x00, 0x91, 60, 100)),
+        )
+
+    # Channel messages are written on the channel of their track
+    def test_message_channel(self):
+        events = [message(0, bytes((0xB0, 7, 90)), 2), note(0, 60, True, 2)]
+        self.assertEqual(
+            encode_body(events),
+            bytes((0x00, 0xB2, 7, 90, 0x00, 0x92, 60, 100)),
+        )
+
+    def test_meta_resets_status(self):
+        tempo = bytes((0xFF, 0x51, 0x03, 0x07, 0xA1, 0x20))
+        events = [note(0, 60, True), message(0, tempo), note(0, 62, True)]
+        self.assertEqual(
+            encode_body(events),
+            bytes((0x00, 0x90, 60, 100, 0x00))
+            + tempo
+            + bytes((0x00, 0x90, 62, 100)),
+        )
+
+    # System exclusive messages are written with their length after the
+    # status byte, and cancel running status too
+    def test_sysex_resets_status(self):
+        sysex = bytes((0xF0, 0x7E, 0x7F, 0x09, 0x01, 0xF7))
+        events = [note(0, 60, True), message(0, sysex), note(0, 62, True)]
+        self.assertEqual(
+            encode_body(events),
+            bytes((0x00, 0x90, 60, 100, 0x00, 0xF0, 5))
+            + sysex[1:]
+            + bytes((0x00, 0x90, 62, 100)),
+        )
+
+    def test_long_delta(self):
+        events = [note(0, 60, True), note(200000, 60, False)]
+        self.assertEqual(
+            encode_body(events),
+            bytes((0x00, 0x90, 60, 100, 0x8C, 0x9A, 0x40, 60, 0)),
+        )
+
+
+@unittest.skipUnless(IMPORT_MIDO, "mido is required to read MIDI files")
+class WriteMidiTest(unittest.TestCase):
+    def setUp(self):
+        self.directory = tempfile.TemporaryDirectory()
+        self.path = os.path.join(self.directory.name, "song.mid")
+
+    def tearDown(self):
+        self.directory.cleanup()
+
+    # Written with running status, meta and system exclusive messages, and
+    # note offs as note ons, then read back by mido
+    def test_round_trip(self):
+        from mido import Message, MetaMessage, MidiFile
+
+        tempo = MetaMessage("set_tempo", tempo=400000)
+        sysex = Message("sysex", data=(0x7E, 0x7F, 0x09, 0x01))
+        conductor = [
+            ScheduledEvent(sort_key(0), 0, None, -1, 0, False, tempo)
+        ]
+        notes = [
+            note(0, 60, True, 1),
+            note(0, 64, True, 1),
+            ScheduledEvent(sort_key(60), 60, None, -1, 0, False, sysex),
+            note(120, 60, False, 1),
+            note(120, 64, False, 1),
+        ]
+        write_midi(self.path, 480, [(None, None, conductor), (1, 5, notes)])
+        self.assertFalse(os.path.exists(self.path + ".tmp"))
+
+        midi = MidiFile(self.path)
+        self.assertEqual(midi.ticks_per_beat, 480)
+        self.assertEqual(
+            [message for message in midi.tracks[0]],
+            [tempo, MetaMessage("end_of_track")],
+        )
+        self.assertEqual(
+            [message for message in midi.tracks[1]],
+            [
+                Message("program_change", channel=1, program=5),
+                Message("note_on", channel=1, note=60, velocity=100),
+                Message("note_on", channel=1, note=64, velocity=100),
+                sysex.copy(time=60),
+                Message("note_on", channel=1, note=60, velocity=0, time=60),
+                Message("note_on", channel=1, note=64, velocity=0),
+                MetaMessage("end_of_track"),
+            ],
+        )
+
+
+if __name__ == "__main__":
+    unittest.main()
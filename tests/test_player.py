@@ -0,0 +1,102 @@
+from threading import Thread
+from typing import Callable, Optional
+import unittest
+from unittest.mock import patch
+
+from musicli_sequencer.output import NullOutput
+from musicli_sequencer.player import KILL_EVENT, PLAY_EVENT, Player
+from musicli_sequencer.song import Song
+
+from helpers import make_note
+
+# The most notes played before a test stops the player
+MAX_NOTES = 6
+
+
+# Time that only passes when the player sleeps or reads the clock, so that
+# playback runs as fast as it can without depending on the machine's load
+class FakeTime:
+    now: float
+
+    def __init__(self):
+        self.now = 0.0
+
+    def perf_counter(self) -> float:
+        self.now += 0.0001
+        return self.now
+
+    def sleep(self, seconds: float) -> None:
+        self.now += seconds
+
+
+# Records the notes played, calling back on the playback thread after the
+# first one, and stops the player once enough have been played
+class RecordingOutput(NullOutput):
+    played: list[int]
+    callback: Optional[Callable[[], None]]
+
+    def __init__(self, callback: Callable[[], None]):
+        self.played = []
+        self.callback = callback
+
+    def note_on(self, channel: int, number: int, velocity: int) -> None:
+        self.played.append(number)
+        callback, self.callback = self.callback, None
+        if callback is not None:
+            callback()
+        if len(self.played) >= MAX_NOTES:
+            KILL_EVENT.set()
+
+
+class LoopTest(unittest.TestCase):
+    def setUp(self):
+        self.song = Song()
+        self.beat = self.song.beats_to_ticks(1)
+        # One note on each beat, each a semitone higher than the last
+        self.song.add_notes(
+            [
+                make_note(self.song, beat * self.beat, 40 + beat)
+                for beat in range(8)
+            ]
+        )
+
+    def tearDown(self):
+        KILL_EVENT.clear()
+        PLAY_EVENT.clear()
+
+    def play(self, callback: Callable[[], None]) -> list[int]:
+        output = RecordingOutput(callback)
+        self.player = Player(output)
+        time = FakeTime()
+        with patch(
+            "musicli_sequencer.player.perf_counter", time.perf_counter
+        ), patch("musicli_sequencer.player.sleep", time.sleep):
+            thread = Thread(
+                target=self.player.play_song, args=[self.song.create_feed()]
+            )
+            thread.start()
+            PLAY_EVENT.set()
+            thread.join(10)
+        self.assertFalse(thread.is_alive())
+        return output.played
+
+    def test_loop(self):
+        def set_loop():
+            self.player.loop = 0, 2 * self.beat
+
+        self.assertEqual(self.play(set_loop), [40, 41] * (MAX_NOTES // 2))
+
+    # An edit outside of the loop seen along with it must not stop the loop's
+    # events from being built
+    def test_loop_after_edit(self):
+        def edit_and_set_loop():
+            self.song.add_note(make_note(self.song, 30 * self.beat))
+            self.player.loop = 0, 2 * self.beat
+
+        self.assertEqual(
+            self.play(edit_and_set_loop), [40, 41] * (MAX_NOTES // 2)
+        )
+
+
+if __name__ == "__main__":
+    unittest.main()
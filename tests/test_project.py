@@ -0,0 +1,323 @@
+from collections import Counter
+import os
+import tempfile
+from threading import Lock
+from typing import Callable, Optional
+import unittest
+from unittest.mock import patch
+
+from musicli_sequencer.journal import Journal, recover_journal
+from musicli_sequencer.project import (
+    EVENTS,
+    HEADER,
+    SECTION_HEADER,
+    ProjectStream,
+    find_sections,
+    load_project,
+    save_project,
+)
+from musicli_sequencer.song import Note, Song
+
+from helpers import add_note, dump, make_note
+
+
+# Runs a callback once, right after the lock is first released, as if another
+# thread had been waiting for it
+class InterruptedLock:
+    lock: Lock
+    callback: Optional[Callable[[], None]]
+
+    def __init__(self, callback: Callable[[], None]):
+        self.lock = Lock()
+        self.callback = callback
+
+    def __enter__(self) -> None:
+        self.lock.acquire()
+
+    def __exit__(self, *args) -> None:
+        self.lock.release()
+        callback, self.callback = self.callback, None
+        if callback is not None:
+            callback()
+
+
+class ProjectTest(unittest.TestCase):
+    def setUp(self):
+        self.directory = tempfile.TemporaryDirectory()
+        self.path = os.path.join(self.directory.name, "song.mcli")
+        self.song = Song()
+        self.add(0, 60)
+        save_project(self.song, self.path)
+
+    def tearDown(self):
+        self.directory.cleanup()
+
+    def add(self, time: int, number: int, track_index: int = 0) -> Note:
+        return add_note(self.song, time, number, track_index)
+
+    def reload(self) -> Song:
+        song = load_project(self.path)
+        self.assertEqual(len(song.tracks), len(self.song.tracks))
+        self.assertEqual(dump(song), dump(self.song))
+        return song
+
+    def read(self) -> bytes:
+        with open(self.path, "rb") as file:
+            return file.read()
+
+    def write(self, data: bytes) -> None:
+        with open(self.path, "wb") as file:
+            file.write(data)
+
+    def assert_clean_load(self) -> None:
+        try:
+            load_project(self.path)
+        except ValueError:
+            pass
+
+    def delete_empty_last_track(self) -> None:
+        self.add(240, 62)
+        self.song.create_track()
+        note = self.add(480, 64, 1)
+        self.song.remove_note(note)
+        self.song.history.commit()
+        self.song.delete_track(self.song.tracks[1])
+
+    def test_delete_empty_last_track(self):
+        self.delete_empty_last_track()
+        save_project(self.song, self.path)
+        self.reload()
+
+    def test_recover_delete_empty_last_track(self):
+        journal_path = self.path + ".journal"
+        journal = Journal(journal_path, self.song, self.path)
+        self.delete_empty_last_track()
+        journal.flush()
+        journal.close()
+        song = load_project(self.path)
+        recover_journal(song, journal_path, self.path)
+        self.assertEqual(dump(song), dump(self.song))
+
+    def open_stopped_journal(self) -> Journal:
+        journal = Journal(self.path + ".journal", self.song, self.path)
+        journal.stop_event.set()
+        journal.thread.join()
+        return journal
+
+    def recover(self) -> Song:
+        song = load_project(self.path)
+        recover_journal(song, self.path + ".journal", self.path)
+        return song
+
+    # A track deleted while the journal is flushed must not change the tracks
+    # written along with edits that were recorded before it was deleted
+    def test_recover_track_deleted_during_flush(self):
+        journal = self.open_stopped_journal()
+        self.song.create_track()
+        self.add(480, 64, 1)
+        expected = dump(self.song)
+        journal.lock = InterruptedLock(
+            lambda: self.song.delete_track(self.song.tracks[1])
+        )
+        # Nothing more is flushed, as if the editor had crashed
+        journal.flush()
+        self.assertEqual(dump(self.recover()), expected)
+
+    # Edits taken for a failed write are written by the next flush
+    def test_recover_after_failed_flush(self):
+        journal = self.open_stopped_journal()
+        self.add(240, 62)
+        journal.flush()
+        self.add(480, 64)
+        with patch(
+            "musicli_sequencer.journal.open",
+            side_effect=OSError("No space left"),
+            create=True,
+        ):
+            with self.assertRaises(OSError):
+                journal.flush()
+        self.add(720, 65)
+        journal.flush()
+        self.assertEqual(dump(self.recover()), dump(self.song))
+
+    # The old journal is kept until a snapshot of the song is fully written
+    def test_recover_after_failed_snapshot(self):
+        journal = self.open_stopped_journal()
+        self.song.create_track()
+        self.add(240, 62, 1)
+        journal.flush()
+        before = dump(self.song)
+        self.song.delete_track(self.song.tracks[0])
+        with patch("os.fsync", side_effect=OSError("No space left")):
+            with self.assertRaises(OSError):
+                journal.flush()
+        self.assertEqual(dump(self.recover()), before)
+        self.assertFalse(os.path.exists(journal.path + ".tmp"))
+        journal.flush()
+        self.assertEqual(dump(self.recover()), dump(self.song))
+
+    # The settings saved after appended edits add the tracks those edits use,
+    # but are read before any of them
+    def test_appended_settings(self):
+        for index in range(4):
+            self.song.key = index
+            self.song.scale_name = "minor" if index % 2 else "major"
+            self.song.create_track()
+            for time in range(0, 960, 120):
+                self.add(time, 48 + index, index + 1)
+            self.assertTrue(save_project(self.song, self.path))
+        song = self.reload()
+        self.assertEqual(song.key, self.song.key)
+        self.assertEqual(song.scale_name, self.song.scale_name)
+
+    # An append cut short is not appended after, since the length of the
+    # partial section would reach into the new ones
+    def test_append_after_torn_append(self):
+        self.add(240, 62)
+        self.assertTrue(save_project(self.song, self.path))
+        self.add(480, 64)
+        self.assertTrue(save_project(self.song, self.path))
+        data = self.read()
+        self.write(data[: len(data) - 12])
+        self.add(720, 65)
+        self.assertFalse(save_project(self.song, self.path))
+        self.reload()
+
+    # A failed append is removed, so that it can be appended again
+    def test_failed_append(self):
+        self.add(240, 62)
+        with patch("os.fsync", side_effect=OSError("No space left")):
+            with self.assertRaises(OSError):
+                save_project(self.song, self.path)
+        self.assertTrue(save_project(self.song, self.path))
+        self.reload()
+
+    def test_failed_save(self):
+        with patch("os.fsync", side_effect=OSError("No space left")):
+            with self.assertRaises(OSError):
+                save_project(self.song, self.path + "2")
+        self.assertEqual(
+            os.listdir(self.directory.name), [os.path.basename(self.path)]
+        )
+
+    def test_truncated(self):
+        self.add(240, 62)
+        save_project(self.song, self.path)
+        data = self.read()
+        for length in range(len(data)):
+            self.write(data[:length])
+            self.assert_clean_load()
+
+    def test_corrupt(self):
+        self.add(240, 62)
+        save_project(self.song, self.path)
+        data = self.read()
+        for tag, position, _ in find_sections(data):
+            if tag == EVENTS:
+                events = position
+        # An event count too large for the columns that follow it
+        corrupt = bytearray(data)
+        corrupt[events : events + 8] = (1 << 40).to_bytes(8, "little")
+        self.write(bytes(corrupt))
+        with self.assertRaises(ValueError):
+            load_project(self.path)
+        for position in range(HEADER.size + SECTION_HEADER.size, len(data)):
+            corrupt = bytearray(data)
+            corrupt[position] ^= 0xFF
+            self.write(bytes(corrupt))
+            self.assert_clean_load()
+
+    def test_truncated_journal(self):
+        journal_path = self.path + ".journal"
+        journal = Journal(journal_path, self.song, self.path)
+        self.delete_empty_last_track()
+        journal.flush()
+        journal.close()
+        with open(journal_path, "rb") as file:
+            data = file.read()
+        for length in range(len(data)):
+            with open(journal_path, "wb") as file:
+                file.write(data[:length])
+            song = load_project(self.path)
+            try:
+                recover_journal(song, journal_path, self.path)
+            except ValueError:
+                pass
+
+
+# Streaming a project applies its appended edits as the events go past, which
+# must give the same notes as loading it
+class ProjectStreamTest(unittest.TestCase):
+    def setUp(self):
+        self.directory = tempfile.TemporaryDirectory()
+        self.path = os.path.join(self.directory.name, "song.mcli")
+        self.song = Song()
+        self.song.create_track()
+        self.notes = [
+            add_note(self.song, time, 60 + time // 120, time // 240 % 2)
+            for time in range(0, 960, 120)
+        ]
+        save_project(self.song, self.path)
+
+    def tearDown(self):
+        self.directory.cleanup()
+
+    def stream(self) -> list[tuple]:
+        with ProjectStream(self.path) as stream:
+            events = list(stream)
+        # Each note's on and off share an ID
+        ids = Counter(note_id for note_id, _ in events)
+        self.assertTrue(all(count == 2 for count in ids.values()))
+        return sorted(
+            (event.time, event.channel, event.number, event.velocity, event.on)
+            for _, event in events
+        )
+
+    def load(self) -> list[tuple]:
+        song = load_project(self.path)
+        return sorted(
+            (event.time, event.channel, event.number, event.velocity, event.on)
+            for event in map(Note.to_scheduled, song.events)
+        )
+
+    def save(self) -> None:
+        self.song.history.commit()
+        self.assertTrue(save_project(self.song, self.path))
+
+    def test_saved(self):
+        self.assertEqual(self.stream(), self.load())
+
+    def test_added_and_removed(self):
+        added = add_note(self.song, 1080, 70, 1)
+        self.song.remove_note(self.notes[2])
+        self.save()
+        self.assertEqual(self.stream(), self.load())
+        self.song.remove_note(added)
+        self.save()
+        self.assertEqual(self.stream(), self.load())
+        self.assertEqual(len(self.stream()), 2 * (len(self.notes) - 1))
+
+    # A removed note added again, in the same or a later section, is played
+    # as it was added
+    def test_added_again(self):
+        removed = self.notes[3]
+        self.song.remove_note(removed)
+        self.song.add_note(
+            make_note(self.song, removed.start, removed.number, 1, 64, 240)
+        )
+        self.save()
+        self.assertEqual(self.stream(), self.load())
+        self.song.remove_note(self.notes[4])
+        self.save()
+        self.song.add_note(
+            make_note(
+                self.song, self.notes[4].start, self.notes[4].number, 0, 32
+            )
+        )
+        self.save()
+        self.assertEqual(self.stream(), self.load())
+        self.assertIn((360, 1, 63, 64, True), self.stream())
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,109 @@
+import json
+import unittest
+
+from musicli_sequencer.output import ALL_NOTES_OFF
+from musicli_sequencer.server import (
+    CC,
+    NOTE_OFF,
+    NOTE_ON,
+    PITCH_BEND,
+    RECORD,
+    Server,
+)
+from musicli_sequencer.song import MIDI_CHANNELS
+
+
+# Hands the server's session the given chunks of data one per read, as a
+# stream socket may split what was sent at any byte
+class FakeConnection:
+    chunks: list[bytes]
+    sent: bytes
+
+    def __init__(self, chunks: list[bytes]):
+        self.chunks = chunks
+        self.sent = b""
+
+    def recv(self, size: int) -> bytes:
+        if len(self.chunks) == 0:
+            return b""
+        chunk = self.chunks.pop(0)
+        assert len(chunk) <= size
+        return chunk
+
+    def sendall(self, data: bytes) -> None:
+        self.sent += data
+
+
+class RecordingOutput:
+    soundfont_path: str
+    played: list[tuple]
+
+    def __init__(self):
+        self.soundfont_path = "soundfont.sf2"
+        self.played = []
+
+    def note_on(self, channel: int, number: int, velocity: int) -> None:
+        self.played.append((NOTE_ON, channel, number, velocity))
+
+    def note_off(self, channel: int, number: int) -> None:
+        self.played.append((NOTE_OFF, channel, number))
+
+    def pitch_bend(self, channel: int, pitch: int) -> None:
+        self.played.append((PITCH_BEND, channel, pitch))
+
+    def cc(self, channel: int, control: int, value: int) -> None:
+        self.played.append((CC, channel, control, value))
+
+
+class SessionTest(unittest.TestCase):
+    def setUp(self):
+        self.server = Server("musicli.sock", "soundfont.sf2")
+        self.output = RecordingOutput()
+        self.server.output = self.output
+        # The session is given the second block of channels
+        self.server.sessions[0] = True
+        self.offset = MIDI_CHANNELS
+
+    def run_session(self, chunks: list[bytes]) -> list[tuple]:
+        connection = FakeConnection(chunks)
+        self.server.run_session(connection)
+        greeting = json.loads(connection.sent)
+        self.assertEqual(greeting["session"], 1)
+        # Every note left playing is stopped once the session ends
+        stops = [
+            (CC, channel, ALL_NOTES_OFF, 0)
+            for channel in range(self.offset, self.offset + MIDI_CHANNELS)
+        ]
+        self.assertEqual(self.output.played[-len(stops) :], stops)
+        self.assertFalse(self.server.sessions[1])
+        return self.output.played[: -len(stops)]
+
+    def test_records(self):
+        data = RECORD.pack(NOTE_ON, 2, 60, 100) + RECORD.pack(
+            PITCH_BEND, 2, -200, 0
+        )
+        self.assertEqual(
+            self.run_session([data]),
+            [
+                (NOTE_ON, self.offset + 2, 60, 100),
+                (PITCH_BEND, self.offset + 2, -200),
+            ],
+        )
+
+    def test_split_record(self):
+        data = RECORD.pack(NOTE_ON, 0, 60, 100) + RECORD.pack(
+            NOTE_OFF, 0, 60, 0
+        )
+        self.assertEqual(
+            self.run_session([data[:4], data[4:9], data[9:]]),
+            [(NOTE_ON, self.offset, 60, 100), (NOTE_OFF, self.offset, 60)],
+        )
+
+    # A session cannot play on another session's channels
+    def test_channel_out_of_range(self):
+        data = RECORD.pack(NOTE_ON, MIDI_CHANNELS, 60, 100)
+        self.assertEqual(self.run_session([data]), [])
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,82 @@
+import unittest
+
+from musicli_sequencer.song import Note, Song
+
+from helpers import dump, make_note
+
+
+class BatchTest(unittest.TestCase):
+    def setUp(self):
+        self.song = Song()
+
+    def note(self, time: int) -> Note:
+        return make_note(self.song, time)
+
+    def test_add_notes(self):
+        self.song.add_notes([self.note(0), self.note(120)])
+        self.assertEqual(len(dump(self.song)), 2)
+
+    def test_add_notes_in_song(self):
+        self.song.add_note(self.note(0))
+        before = dump(self.song)
+        with self.assertRaises(ValueError):
+            self.song.add_notes([self.note(240), self.note(0)])
+        self.assertEqual(dump(self.song), before)
+
+    def test_add_notes_in_batch(self):
+        with self.assertRaises(ValueError):
+            self.song.add_notes([self.note(0), self.note(0)])
+        self.assertEqual(dump(self.song), [])
+
+    # A note at the same start with a different length is a different note,
+    # as it is for add_note
+    def test_add_notes_overlapping(self):
+        self.song.add_note(self.note(0))
+        longer = make_note(self.song, 0, duration=240)
+        self.song.add_notes([longer])
+        self.assertEqual(len(dump(self.song)), 2)
+
+    # A rejected edit leaves nothing to undo or save
+    def test_edit_notes_onto_note(self):
+        self.song.add_notes([self.note(0), self.note(120), self.note(240)])
+        self.song.history.commit()
+        self.song.unsaved_edits = []
+        before = dump(self.song)
+        notes = self.song.get_notes_starting_between(120)
+        with self.assertRaises(ValueError):
+            self.song.edit_notes(
+                notes, lambda note: note.move(note.start - 120)
+            )
+        self.assertEqual(dump(self.song), before)
+        self.assertEqual(self.song.unsaved_edits, [])
+        self.song.history.commit()
+        self.assertEqual(self.song.history.undo(self.song), 3)
+        self.assertEqual(dump(self.song), [])
+
+    def test_edit_notes_undo(self):
+        self.song.add_notes([self.note(0), self.note(120)])
+        self.song.history.commit()
+        before = dump(self.song)
+        self.song.edit_notes(
+            self.song.get_notes_starting_between(0),
+            lambda note: note.set_number(note.number + 2),
+        )
+        after = dump(self.song)
+        self.song.history.commit()
+        self.song.history.undo(self.song)
+        self.assertEqual(dump(self.song), before)
+        self.song.history.redo(self.song)
+        self.assertEqual(dump(self.song), after)
+
+    def test_edit_notes_together(self):
+        self.song.add_notes([self.note(0), self.note(60)])
+        with self.assertRaises(ValueError):
+            self.song.edit_notes(
+                self.song.get_notes_starting_between(0),
+                lambda note: note.move(0),
+            )
+        self.assertEqual(len(dump(self.song)), 2)
+
+
+if __name__ == "__main__":
+    unittest.main()